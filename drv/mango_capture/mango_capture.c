@@ -0,0 +1,383 @@
+/*
+ * Traffic capture for Mango data channels and networking.
+ *
+ * Copyright (c) 2016 ilbers GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Every CPU records into its own ring of fixed size slots, overwriting the
+ * oldest ones. Writers take no lock and only disable preemption: a slot is
+ * claimed by incrementing the per-CPU head, and its sequence number is odd
+ * while it is filled. The reader copies a slot and drops it if the sequence
+ * number was odd or changed meanwhile, so the writers never wait for it.
+ *
+ * The data channel and net drivers do not depend on this module. It hooks
+ * into those which are loaded when it is, so load it after them.
+ *
+ * Reading <debugfs>/mango_capture/capture.pcap takes a snapshot of all the
+ * rings, ordered by time, in pcap format:
+ *
+ *   cat /sys/kernel/debug/mango_capture/capture.pcap > mango.pcap
+ *
+ * Frames use LINKTYPE_USER0 and start with struct mango_cap_hdr, followed
+ * by the first snaplen bytes of the data.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+
+#include <mango_capture.h>
+
+#define CAP_SNAP_MAX		64		/* Largest captured prefix */
+#define CAP_SLOTS		4096		/* Default slots per CPU */
+#define CAP_SLOTS_MIN		64		/* Nested writers never wrap onto each other */
+#define CAP_SLOTS_MAX		(1 << 20)	/* Keeps the snapshot size in range */
+
+/* Bytes of one pcap record in a snapshot */
+#define CAP_REC_SIZE	(sizeof(struct pcap_rec_hdr) +			\
+			 sizeof(struct mango_cap_hdr) + CAP_SNAP_MAX)
+
+#define PCAP_MAGIC_NS		0xa1b23c4d	/* pcap with ns timestamps */
+#define PCAP_LINKTYPE_USER0	147
+
+struct cap_slot {
+	u32 seq;				/* Odd while the slot is written */
+	u16 type;
+	u16 id;
+	u32 len;				/* Original length */
+	u32 caplen;				/* Bytes in data */
+	u64 stamp;				/* ktime, ns */
+	u8  data[CAP_SNAP_MAX];
+};
+
+struct cap_ring {
+	unsigned long   head;			/* Slots claimed so far */
+	struct cap_slot *slots;
+};
+
+/* Slot copied by the reader */
+struct cap_rec {
+	unsigned int    cpu;
+	struct cap_slot slot;
+};
+
+struct pcap_file_hdr {
+	u32 magic;
+	u16 version_major;
+	u16 version_minor;
+	s32 thiszone;
+	u32 sigfigs;
+	u32 snaplen;
+	u32 linktype;
+};
+
+struct pcap_rec_hdr {
+	u32 ts_sec;
+	u32 ts_nsec;
+	u32 incl_len;
+	u32 orig_len;
+};
+
+/* Snapshot handed to one reader */
+struct cap_snapshot {
+	size_t len;
+	char   buf[];
+};
+
+static DEFINE_PER_CPU(struct cap_ring, cap_rings);
+
+static bool enable = true;
+static unsigned int snaplen;
+static unsigned int slots = CAP_SLOTS;
+
+static struct dentry *cap_dir;
+
+/* Capture hooks of the drivers loaded at init */
+static void (*cap_set_dc)(mango_capture_fn fn);
+static void (*cap_set_net)(mango_capture_fn fn);
+
+/* Called by the drivers with preemption disabled */
+static void cap_record(unsigned int type, unsigned int id,
+		       const void *data, unsigned int len)
+{
+	struct cap_ring *ring;
+	struct cap_slot *slot;
+	unsigned int caplen;
+
+	if (!ACCESS_ONCE(enable))
+		return;
+
+	caplen = data ? min3(len, ACCESS_ONCE(snaplen), (unsigned int)CAP_SNAP_MAX) : 0;
+
+	ring = this_cpu_ptr(&cap_rings);
+	slot = &ring->slots[(this_cpu_inc_return(cap_rings.head) - 1) & (slots - 1)];
+
+	slot->seq++;
+	smp_wmb();
+
+	slot->type   = type;
+	slot->id     = id;
+	slot->len    = len;
+	slot->caplen = caplen;
+	slot->stamp  = ktime_to_ns(ktime_get());
+	memcpy(slot->data, data, caplen);
+
+	smp_wmb();
+	slot->seq++;
+}
+
+static int cap_cmp(const void *a, const void *b)
+{
+	const struct cap_rec *ra = a, *rb = b;
+
+	if (ra->slot.stamp == rb->slot.stamp)
+		return 0;
+
+	return ra->slot.stamp < rb->slot.stamp ? -1 : 1;
+}
+
+/* Copy the complete slots of all rings, returns the number of records */
+static unsigned int cap_collect(struct cap_rec *rec)
+{
+	struct cap_slot *src;
+	unsigned int i, n = 0;
+	u32 seq;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		src = per_cpu_ptr(&cap_rings, cpu)->slots;
+
+		for (i = 0; i < slots; i++, src++) {
+			seq = ACCESS_ONCE(src->seq);
+			if (!seq || (seq & 1))
+				continue;
+
+			smp_rmb();
+			memcpy(&rec->slot, src, sizeof(*src));
+			smp_rmb();
+
+			/* Overwritten while copying */
+			if (ACCESS_ONCE(src->seq) != seq)
+				continue;
+
+			rec->cpu = cpu;
+			rec++;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+static size_t cap_format(char *buf, struct cap_rec *rec, unsigned int n)
+{
+	struct pcap_file_hdr *fh = (struct pcap_file_hdr *)buf;
+	s64 offset = ktime_to_ns(ktime_sub(ktime_get_real(), ktime_get()));
+	struct mango_cap_hdr *ch;
+	struct pcap_rec_hdr *rh;
+	char *p = buf + sizeof(*fh);
+	unsigned int i;
+	u32 nsec;
+
+	fh->magic         = PCAP_MAGIC_NS;
+	fh->version_major = 2;
+	fh->version_minor = 4;
+	fh->thiszone      = 0;
+	fh->sigfigs       = 0;
+	fh->snaplen       = sizeof(*ch) + CAP_SNAP_MAX;
+	fh->linktype      = PCAP_LINKTYPE_USER0;
+
+	for (i = 0; i < n; i++, rec++) {
+		rh = (struct pcap_rec_hdr *)p;
+		ch = (struct mango_cap_hdr *)(rh + 1);
+
+		rh->ts_sec   = div_u64_rem(rec->slot.stamp + offset,
+					   NSEC_PER_SEC, &nsec);
+		rh->ts_nsec  = nsec;
+		rh->incl_len = sizeof(*ch) + rec->slot.caplen;
+		rh->orig_len = sizeof(*ch) + rec->slot.len;
+
+		ch->type = rec->slot.type;
+		ch->cpu  = rec->cpu;
+		ch->id   = cpu_to_be16(rec->slot.id);
+		ch->len  = cpu_to_be32(rec->slot.len);
+
+		memcpy(ch + 1, rec->slot.data, rec->slot.caplen);
+
+		p += sizeof(*rh) + rh->incl_len;
+	}
+
+	return p - buf;
+}
+
+static int cap_open(struct inode *inode, struct file *filep)
+{
+	unsigned long nr = (unsigned long)num_possible_cpus() * slots;
+	struct cap_snapshot *snap;
+	struct cap_rec *recs;
+	unsigned int n;
+
+	if (nr > (ULONG_MAX - sizeof(*snap) - sizeof(struct pcap_file_hdr)) /
+		  max(sizeof(*recs), CAP_REC_SIZE))
+		return -ENOMEM;
+
+	recs = vmalloc(nr * sizeof(*recs));
+	if (!recs)
+		return -ENOMEM;
+
+	snap = vmalloc(sizeof(*snap) + sizeof(struct pcap_file_hdr) +
+		       nr * CAP_REC_SIZE);
+	if (!snap) {
+		vfree(recs);
+		return -ENOMEM;
+	}
+
+	n = cap_collect(recs);
+	sort(recs, n, sizeof(*recs), cap_cmp, NULL);
+	snap->len = cap_format(snap->buf, recs, n);
+
+	vfree(recs);
+
+	filep->private_data = snap;
+
+	return 0;
+}
+
+static ssize_t cap_read(struct file *filep, char __user *buffer,
+			size_t length, loff_t *offset)
+{
+	struct cap_snapshot *snap = filep->private_data;
+
+	return simple_read_from_buffer(buffer, length, offset,
+				       snap->buf, snap->len);
+}
+
+static int cap_release(struct inode *inode, struct file *filep)
+{
+	vfree(filep->private_data);
+
+	return 0;
+}
+
+static const struct file_operations cap_fops = {
+	.owner   = THIS_MODULE,
+	.open    = cap_open,
+	.read    = cap_read,
+	.llseek  = default_llseek,
+	.release = cap_release,
+};
+
+static void cap_free_rings(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		vfree(per_cpu_ptr(&cap_rings, cpu)->slots);
+		per_cpu_ptr(&cap_rings, cpu)->slots = NULL;
+	}
+}
+
+/* Install the hook into the loaded drivers, @fn NULL removes it */
+static void cap_hook(mango_capture_fn fn)
+{
+	if (cap_set_dc)
+		cap_set_dc(fn);
+	if (cap_set_net)
+		cap_set_net(fn);
+}
+
+static void cap_module_exit(void)
+{
+	debugfs_remove_recursive(cap_dir);
+
+	/* Waits for the running records */
+	cap_hook(NULL);
+
+	if (cap_set_dc)
+		symbol_put(mango_dc_set_capture);
+	if (cap_set_net)
+		symbol_put(mango_net_set_capture);
+
+	cap_free_rings();
+}
+
+static int __init cap_module_init(void)
+{
+	struct cap_ring *ring;
+	int cpu;
+
+	/* A small ring lets a nested IRQ overwrite a slot still being filled */
+	if (slots < CAP_SLOTS_MIN || slots > CAP_SLOTS_MAX) {
+		printk(KERN_ALERT "mango_capture: slots must be %d to %d\n",
+		       CAP_SLOTS_MIN, CAP_SLOTS_MAX);
+		return -EINVAL;
+	}
+	slots = roundup_pow_of_two(slots);
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(&cap_rings, cpu);
+		ring->slots = vzalloc_node(slots * sizeof(struct cap_slot),
+					   cpu_to_node(cpu));
+		if (!ring->slots) {
+			printk(KERN_ALERT "mango_capture: failed to allocate ring for CPU %d\n",
+			       cpu);
+			cap_free_rings();
+			return -ENOMEM;
+		}
+	}
+
+	cap_dir = debugfs_create_dir("mango_capture", NULL);
+	if (!cap_dir ||
+	    !debugfs_create_file("capture.pcap", S_IRUSR, cap_dir, NULL, &cap_fops)) {
+		printk(KERN_ALERT "mango_capture: failed to create debugfs files\n");
+		debugfs_remove_recursive(cap_dir);
+		cap_free_rings();
+		return -ENOMEM;
+	}
+
+	/* Only the drivers which are loaded, holding them while hooked */
+	cap_set_dc  = symbol_get(mango_dc_set_capture);
+	cap_set_net = symbol_get(mango_net_set_capture);
+	if (!cap_set_dc && !cap_set_net)
+		printk(KERN_ALERT "mango_capture: no data channel or net driver loaded\n");
+
+	cap_hook(cap_record);
+
+	return 0;
+}
+
+module_init(cap_module_init);
+module_exit(cap_module_exit);
+
+module_param(enable, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(enable, "record data channel and network traffic");
+module_param(snaplen, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(snaplen, "bytes of data captured per record, at most 64");
+module_param(slots, uint, S_IRUGO);
+MODULE_PARM_DESC(slots, "records kept per CPU, 64 to 1048576, rounded up to a power of 2");
+
+MODULE_AUTHOR("Alexander Smirnov");
+MODULE_DESCRIPTION("Mango Traffic Capture");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,323 @@
+/*
+ * Linux console driver for Mango.
+ *
+ * Copyright (c) 2016 ilbers GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Kernel messages are staged in a per-CPU buffer and passed to Mango by an
+ * irq_work, one hypercall per batch. Console writes are serialized by the
+ * console lock and run with interrupts off, and only the owning CPU adds to
+ * its buffer, so no lock is needed. When the console lock moves to another
+ * CPU, the new owner writes out the previous buffer itself, which keeps the
+ * output in order without waiting for the irq_work. Whoever claims the
+ * buffer length with cmpxchg() writes the data, so nothing is written
+ * twice. During an oops, and once the system halts or reboots, all staged
+ * buffers are flushed and the output is written synchronously.
+ *
+ * The hvc tty (/dev/hvc0) writes whole output buffers with one hypercall.
+ * Built into the kernel, "earlycon=mango" prints boot messages with direct
+ * hypercalls until the console proper is registered.
+ */
+
+#include <linux/console.h>
+#include <linux/init.h>
+#include <linux/irq_work.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/reboot.h>
+#include <linux/serial_core.h>
+
+#include <hvc_console.h>
+
+#include <mango.h>
+
+#define MC_BUF_SIZE		4096	/* Per-CPU staging buffer */
+#define MC_HVC_OUTBUF		4096	/* hvc tty output buffer */
+#define MC_VTERMNO		0	/* hvc terminal number */
+#define MC_BUF_BUSY		0x80000000	/* len flag, data is being written out */
+
+struct mc_buf {
+	unsigned int     len;		/* Staged bytes, MC_BUF_BUSY while flushed */
+	struct irq_work  work;
+	char             data[MC_BUF_SIZE];
+};
+
+static DEFINE_PER_CPU(struct mc_buf, mc_bufs);
+
+/* CPU which staged output last, -1 if none */
+static int mc_last_cpu = -1;
+
+static bool buffered = true;
+
+static struct hvc_struct *mc_hvc;
+
+/*
+ * Pass data to Mango, retrying as long as it makes progress. Returns the
+ * number of bytes taken.
+ */
+static unsigned int mc_write(const char *p, unsigned int len)
+{
+	unsigned int count, done = 0;
+
+	while (done < len) {
+		count = mango_console_write(p + done, len - done);
+		if (!count || count > len - done)
+			break;
+
+		done += count;
+	}
+
+	return done;
+}
+
+/*
+ * Write out a staged buffer, called with interrupts off. The irq_work of
+ * the owning CPU and the next console owner may race, only the one which
+ * claims the data writes it.
+ */
+static void mc_flush(struct mc_buf *buf)
+{
+	unsigned int len = ACCESS_ONCE(buf->len);
+
+	if (!len || (len & MC_BUF_BUSY) ||
+	    cmpxchg(&buf->len, len, len | MC_BUF_BUSY) != len)
+		return;
+
+	mc_write(buf->data, len);
+
+	smp_mb();
+	ACCESS_ONCE(buf->len) = 0;
+}
+
+static void mc_flush_work(struct irq_work *work)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	mc_flush(container_of(work, struct mc_buf, work));
+	local_irq_restore(flags);
+}
+
+/*
+ * Write out the buffer of the previous console owner. If its irq_work is
+ * writing it right now, wait for that single hypercall to finish.
+ */
+static void mc_flush_prev(int cpu)
+{
+	struct mc_buf *prev = per_cpu_ptr(&mc_bufs, cpu);
+
+	mc_flush(prev);
+
+	while (ACCESS_ONCE(prev->len) & MC_BUF_BUSY)
+		cpu_relax();
+}
+
+/*
+ * The other CPUs may be stopped with output still staged, their irq_work
+ * will not run anymore. Never waits for them.
+ */
+static void mc_flush_all(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		mc_flush(per_cpu_ptr(&mc_bufs, cpu));
+}
+
+/* Interrupts are off for good in machine_halt() and machine_restart() */
+static bool mc_going_down(void)
+{
+	return system_state > SYSTEM_RUNNING;
+}
+
+static void mc_console_write(struct console *con, const char *s, unsigned n)
+{
+	struct mc_buf *buf;
+	unsigned long flags;
+	int cpu;
+
+	local_irq_save(flags);
+
+	cpu = smp_processor_id();
+	buf = this_cpu_ptr(&mc_bufs);
+
+	/* The irq_work may never run once the kernel is going down */
+	if (oops_in_progress) {
+		mc_flush_all();
+		mc_last_cpu = cpu;
+		mc_write(s, n);
+		goto out;
+	}
+
+	/* Output staged by the previous owner goes first */
+	if (mc_last_cpu >= 0 && mc_last_cpu != cpu)
+		mc_flush_prev(mc_last_cpu);
+	mc_last_cpu = cpu;
+
+	if (!buffered || mc_going_down()) {
+		mc_flush(buf);
+		mc_write(s, n);
+		goto out;
+	}
+
+	if (buf->len + n > MC_BUF_SIZE)
+		mc_flush(buf);
+
+	if (n > MC_BUF_SIZE) {
+		mc_write(s, n);
+		goto out;
+	}
+
+	memcpy(buf->data + buf->len, s, n);
+	buf->len += n;
+
+	irq_work_queue(&buf->work);
+
+out:
+	local_irq_restore(flags);
+}
+
+static struct console mc_console = {
+	.name  = "mango",
+	.write = mc_console_write,
+	.flags = CON_PRINTBUFFER,
+	.index = -1,
+};
+
+/*
+ * Output staged before a halt or reboot would be lost otherwise. The
+ * console lock keeps the CPUs from adding to their buffers meanwhile.
+ */
+static int mc_reboot_notify(struct notifier_block *nb, unsigned long action,
+			    void *data)
+{
+	unsigned long flags;
+
+	console_lock();
+	local_irq_save(flags);
+	mc_flush_all();
+	local_irq_restore(flags);
+	console_unlock();
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block mc_reboot_nb = {
+	.notifier_call = mc_reboot_notify,
+	.priority      = INT_MIN,		/* After the drivers had their say */
+};
+
+/* hvc keeps the bytes Mango did not take and retries them */
+static int mc_hvc_put_chars(uint32_t vtermno, const char *buf, int count)
+{
+	return mc_write(buf, count);
+}
+
+/* Mango has no console input */
+static int mc_hvc_get_chars(uint32_t vtermno, char *buf, int count)
+{
+	return 0;
+}
+
+static const struct hv_ops mc_hvc_ops = {
+	.get_chars = mc_hvc_get_chars,
+	.put_chars = mc_hvc_put_chars,
+};
+
+#ifndef MODULE
+static void mc_early_write(struct console *con, const char *s, unsigned n)
+{
+	mc_write(s, n);
+}
+
+static int __init mc_early_setup(struct earlycon_device *device,
+				 const char *opt)
+{
+	device->con->write = mc_early_write;
+
+	return 0;
+}
+EARLYCON_DECLARE(mango, mc_early_setup);
+#endif
+
+static int __init mc_console_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		init_irq_work(&per_cpu(mc_bufs, cpu).work, mc_flush_work);
+
+	register_console(&mc_console);
+	register_reboot_notifier(&mc_reboot_nb);
+
+	return 0;
+}
+
+static void mc_module_exit(void)
+{
+	int cpu;
+
+	if (mc_hvc)
+		hvc_remove(mc_hvc);
+
+	unregister_reboot_notifier(&mc_reboot_nb);
+	unregister_console(&mc_console);
+
+	for_each_possible_cpu(cpu)
+		irq_work_sync(&per_cpu(mc_bufs, cpu).work);
+}
+
+static int __init mc_module_init(void)
+{
+	struct hvc_struct *hp;
+
+#ifdef MODULE
+	mc_console_init();
+#endif
+
+	/* No IRQ, hvc polls get_chars */
+	hp = hvc_alloc(MC_VTERMNO, 0, &mc_hvc_ops, MC_HVC_OUTBUF);
+	if (IS_ERR(hp)) {
+		printk(KERN_ALERT "mango_console: failed to allocate hvc with %ld\n",
+		       PTR_ERR(hp));
+		mc_module_exit();
+		return PTR_ERR(hp);
+	}
+
+	mc_hvc = hp;
+
+	return 0;
+}
+
+#ifndef MODULE
+/* Built in, the console comes up long before the device drivers */
+console_initcall(mc_console_init);
+#endif
+
+module_init(mc_module_init);
+module_exit(mc_module_exit);
+
+module_param(buffered, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(buffered, "batch console output per CPU, 0 writes synchronously");
+
+MODULE_AUTHOR("Alexander Smirnov");
+MODULE_DESCRIPTION("Mango Console");
+MODULE_LICENSE("GPL");
+/* Hypercalls are inline, mango_core must unlock Mango first */
+MODULE_SOFTDEP("pre: mango_core");
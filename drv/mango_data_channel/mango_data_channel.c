@@ -17,254 +17,2633 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <linux/atomic.h>
+#include <linux/cdev.h>
 #include <linux/cpu.h>
+#include <linux/crypto.h>
 #include <linux/interrupt.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
 #include <asm/uaccess.h>
 #include <linux/wait.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/workqueue.h>
 
 #include <mango.h>
+#include <mango_capture.h>
+#include <mango_dc.h>
 #include <ring_buffer.h>
 
+#define CREATE_TRACE_POINTS
+#include "mango_dc_trace.h"
+
 #define DC_IRQ_NR		130		/* Base Mango Data Channel physical IRQ */
 
 #define CLASS_NAME		"mango_dc"	/* Device class name */
 #define DEVICE_NAME		"dc"		/* Device name as it appears in /proc/devices */
-#define DC_BUFFER_SIZE		256		/* Ring buffer size to store incomming data */
+#define DC_MAX_DEVS		256		/* Minors reserved for data channels */
+#define DC_MAX_GROUPS		16		/* Minors reserved for multicast groups */
+#define DC_MAX_MINORS		(DC_MAX_DEVS + DC_MAX_GROUPS)
+#define DC_GROUP_MAX_MEMBERS	16		/* Channels in one multicast group */
+#define GROUP_NAME		"dcg"		/* Multicast group device name */
+#define DC_BUFFER_SIZE		256		/* Default ring buffer size, staging buffers size */
+#define DC_BUFFER_SIZE_MAX	65536		/* Largest ring buffer size */
+#define DC_MSG_HDR_SIZE		2		/* Record length prefix in message mode */
+#define DC_RX_BUDGET		4096		/* Bytes drained before rescheduling */
+#define DC_RT_BUDGET		DC_BUFFER_SIZE	/* Same in RT mode */
+#define DC_LAT_BUCKETS		20		/* Latency histogram, log2 of us */
+
+/* Block codecs, a coded channel runs in Mango message mode */
+#define DC_CODEC_NONE		0		/* Block carries raw data */
+#define DC_CODEC_RLE		1		/* Run length encoding */
+#define DC_CODEC_DELTA		2		/* Byte deltas, run length encoded */
+#define DC_CODEC_LZ4		3		/* LZ4 through the crypto API */
+#define DC_CODEC_MAX		4
+#define DC_CODEC_HDR_SIZE	3		/* Codec, raw length */
+#define DC_CODEC_PAYLOAD	(MANGO_DC_MSG_MAX - DC_CODEC_HDR_SIZE)
+#define DC_CODEC_BLOCK		1024		/* Largest raw block */
 
-RING_BUFFER(dc_buffer_t, unsigned char, DC_BUFFER_SIZE);
+#define dc_user_ptr(p)		((void __user *)(unsigned long)(p))
+
+RING_BUFFER_DYNAMIC(dc_buffer_t, unsigned char);
 
 struct dc_dev_t {
-	int               major;		/* Device major number */
+	struct cdev       *cdev;		/* Character device, minor is ch */
 	int               is_open;		/* Device open flag */
 	int               irq;			/* IRQ line assigned to the device */
 	int               ch;			/* Mango data channel identifier */
 	int               dest;			/* Destination partition for channel */
-	spinlock_t        lock;			/* Synchronization */
+	int               cpu;			/* CPU serving the channel, -1 if any */
+	unsigned int      mode;			/* MANGO_DC_MODE_* */
+	unsigned int      nr_msgs;		/* Records queued in message mode */
+	unsigned long     rx_dropped;		/* Records dropped on full buffer */
+	unsigned long     rx_overwritten;	/* Stream bytes lost on full buffer */
+	unsigned int      rt;			/* RT mode enabled */
+	unsigned int      busy_poll_us;		/* RT mode busy-wait before sleeping */
+	atomic64_t        rx_stamp;		/* Arrival of the oldest unread data, ns */
+	unsigned long     lat_hist[DC_LAT_BUCKETS]; /* Arrival to read latency */
+	u64               lat_max;		/* Worst latency, us */
+	int               groups;		/* Multicast groups using the channel,
+						   dc_devs_lock and tx_lock */
+	unsigned int      codec;		/* DC_CODEC_* used for sending */
+	struct crypto_comp *tfm;		/* LZ4 transform, if codec is LZ4 */
+	struct crypto_comp *rx_tfm;		/* LZ4 decoder, if codec is not none */
+	spinlock_t        lock;			/* Ring buffer, process context only */
+	struct mutex      tx_lock;		/* Serializes writers */
+	struct mutex      rx_lock;		/* Serializes readers */
+	struct mutex      drain_lock;		/* Serializes reads from Mango */
 	struct list_head  list;			/* Device list entry */
 	wait_queue_head_t wq;			/* Waitqueue for I/O operations */
 	struct device     *dev;
+	struct mango_dc_client *client;		/* In-kernel consumer, if attached */
+	spinlock_t        tx_queue_lock;	/* Protects tx_queue */
+	struct list_head  tx_queue;		/* Client transmit requests */
+	struct delayed_work tx_work;		/* Sends client requests */
+	struct work_struct reset_work;		/* Recovers from a failed hypercall */
+	int               dying;		/* Channel is torn down, no more resets */
+	unsigned int      reset_flush;		/* Discard queued data on reset */
+	unsigned long     resets;		/* Completed resets */
+	u64               reset_last_us;	/* Duration of the last reset */
+	u64               reset_max_us;		/* Longest reset */
 	dc_buffer_t       buff;			/* Internal device buffer */
+	unsigned char     tx_buf[DC_BUFFER_SIZE]; /* Outgoing data staging */
+	unsigned char     rx_buf[DC_BUFFER_SIZE]; /* Incoming record staging */
+	unsigned char     codec_raw[DC_CODEC_BLOCK]; /* Block to encode, tx_lock */
+	unsigned char     codec_rec[MANGO_DC_MSG_MAX]; /* Encoded block, tx_lock */
+	unsigned char     codec_out[DC_CODEC_BLOCK]; /* Decoded block, drain_lock */
+};
+
+/* Multicast group member, one per destination partition */
+struct dc_member_t {
+	struct dc_dev_t   *dev;
+	unsigned long     sent;			/* Writes accepted by Mango */
+	unsigned long     dropped;		/* Writes dropped, no room */
+	unsigned long     dropped_bytes;
+};
+
+/*
+ * Multicast group: every write goes to all member channels. Members are
+ * channels created as usual, each bound to its destination partition, and
+ * can still be read and written on their own.
+ */
+struct dc_group_t {
+	struct cdev        *cdev;		/* Character device, minor is DC_MAX_DEVS + id */
+	int                id;
+	int                is_open;		/* Device open flag */
+	int                nr_members;
+	struct mutex       lock;		/* Serializes writers, protects buf and stats */
+	struct list_head   list;		/* Group list entry */
+	struct device      *dev;
+	unsigned char      buf[DC_BUFFER_SIZE]; /* Write copied from user space */
+	struct dc_member_t members[DC_GROUP_MAX_MEMBERS];
+};
+
+struct mango_dc_client {
+	struct dc_dev_t                  *dev;
+	const struct mango_dc_client_ops *ops;
+	void                             *priv;
 };
 
 /* Data Channel devices list */
 static LIST_HEAD(dc_devs_list);
 
-/* Number of Data Channel devices */
+/* Multicast groups list */
+static LIST_HEAD(dc_groups_list);
+
+/* Protects the devices and groups lists and the open flags */
+static DEFINE_MUTEX(dc_devs_lock);
+
+/* Number of Data Channel devices created at load time */
 static int nr_devs = 1;
 
+/* Character device region shared by all channels */
+static dev_t dc_devt;
+
 /* Destination partition for data channels */
 static int dest_part = 1;
 
 /* Data Channel device class */
 struct class  *class_dc;
 
-static irqreturn_t dc_mango_irq(int irq, void *data)
+/* Installed by mango_capture while it is loaded */
+static mango_capture_fn __rcu dc_capture_hook;
+
+/*
+ * Mango fails the calls of a channel whose peer partition was restarted.
+ * The channel is then reset in place, the failed call took no data.
+ */
+static int dc_hvc_ret(struct dc_dev_t *dev, unsigned int ret)
+{
+	if ((int)ret < 0) {
+		if (!ACCESS_ONCE(dev->dying))
+			schedule_work(&dev->reset_work);
+		return 0;
+	}
+
+	return ret;
+}
+
+/* Read from Mango, every hypercall which moves data is captured */
+static int dc_hvc_read(struct dc_dev_t *dev, unsigned char *p, unsigned int len)
+{
+	int count = dc_hvc_ret(dev, mango_dc_read(dev->ch, p, len));
+
+	if (count)
+		mango_capture(&dc_capture_hook, MANGO_CAP_DC_RX, dev->ch, p, count);
+
+	return count;
+}
+
+static int dc_hvc_write(struct dc_dev_t *dev, const unsigned char *p,
+			unsigned int len)
+{
+	int count = dc_hvc_ret(dev, mango_dc_write(dev->ch, p, len));
+
+	if (count)
+		mango_capture(&dc_capture_hook, MANGO_CAP_DC_TX, dev->ch, p, count);
+
+	return count;
+}
+
+/* Copy data to the ring tail, the oldest bytes are overwritten */
+static void dc_ring_put(struct dc_dev_t *dev, const unsigned char *buf, int count)
+{
+	int tail = RING_BUFFER_TAIL(dev->buff);
+	int chunk = min(count, dev->buff.size - tail);
+
+	memcpy(&dev->buff.buf[tail], buf, chunk);
+	memcpy(dev->buff.buf, buf + chunk, count - chunk);
+
+	RING_BUFFER_COMMIT(dev->buff, count);
+}
+
+/* Copy data at @offset from the ring head without consuming it */
+static void dc_ring_peek(struct dc_dev_t *dev, int offset,
+			 unsigned char *buf, int count)
+{
+	int pos = (dev->buff.start + offset) & (dev->buff.size - 1);
+	int chunk = min(count, dev->buff.size - pos);
+
+	memcpy(buf, &dev->buff.buf[pos], chunk);
+	memcpy(buf + chunk, dev->buff.buf, count - chunk);
+}
+
+/* Copy data from the ring head, the caller checks the fill level */
+static void dc_ring_get(struct dc_dev_t *dev, unsigned char *buf, int count)
+{
+	dc_ring_peek(dev, 0, buf, count);
+
+	RING_BUFFER_SKIP(dev->buff, count);
+}
+
+/*
+ * Store one incoming record prefixed by its length. Records which do not fit
+ * into the free space are dropped as a whole, so the buffer never holds
+ * a partial record.
+ */
+static void dc_push_msg(struct dc_dev_t *dev, unsigned char *buf, int count)
+{
+	unsigned char hdr[DC_MSG_HDR_SIZE] = { count & 0xff, count >> 8 };
+
+	if (count > MANGO_DC_MSG_MAX ||
+	    RING_BUFFER_FREE(dev->buff) < count + DC_MSG_HDR_SIZE) {
+		dev->rx_dropped++;
+		return;
+	}
+
+	dc_ring_put(dev, hdr, DC_MSG_HDR_SIZE);
+	dc_ring_put(dev, buf, count);
+
+	dev->nr_msgs++;
+}
+
+/* Fetch up to @len bytes of stream data, called with dev->lock held */
+static int dc_pop_stream(struct dc_dev_t *dev, unsigned char *buf, int len)
+{
+	int count = min(len, RING_BUFFER_FILL(dev->buff));
+
+	dc_ring_get(dev, buf, count);
+
+	return count;
+}
+
+/*
+ * Fetch one record, called with dev->lock held. The part of the record which
+ * does not fit into @len bytes is discarded. Returns the record length.
+ */
+static int dc_pop_msg(struct dc_dev_t *dev, unsigned char *buf, int len)
+{
+	unsigned char hdr[DC_MSG_HDR_SIZE];
+	int size;
+
+	if (!dev->nr_msgs)
+		return 0;
+
+	dc_ring_get(dev, hdr, DC_MSG_HDR_SIZE);
+	size = hdr[0] | (hdr[1] << 8);
+
+	/* Not a record header, the framing is lost: drop everything */
+	if (size > RING_BUFFER_FILL(dev->buff)) {
+		printk_ratelimited(KERN_ALERT "mango_dc: dc#%d has a broken record, buffer reset\n",
+				   dev->ch);
+		RING_BUFFER_RESET(dev->buff);
+		dev->nr_msgs = 0;
+		return 0;
+	}
+
+	if (size > len) {
+		dc_ring_get(dev, buf, len);
+		RING_BUFFER_SKIP(dev->buff, size - len);
+	} else {
+		dc_ring_get(dev, buf, size);
+	}
+
+	dev->nr_msgs--;
+
+	return size;
+}
+
+/*
+ * Run length encoding with an optional byte delta transform. A control byte
+ * c < 128 is followed by c + 1 literal bytes, c >= 128 by one byte repeated
+ * c - 126 times. Returns the encoded length or -1 if it exceeds @dmax.
+ */
+static int dc_rle_encode(const unsigned char *src, int slen,
+			 unsigned char *dst, int dmax, int delta)
+{
+	int i = 0, o = 0, run, lit;
+
+#define DC_RLE_SRC(k)	((unsigned char)(src[k] - ((delta && (k)) ? src[(k) - 1] : 0)))
+
+	while (i < slen) {
+		for (run = 1; i + run < slen && run < 129 &&
+		     DC_RLE_SRC(i + run) == DC_RLE_SRC(i); run++)
+			;
+
+		if (run >= 2) {
+			if (o + 2 > dmax)
+				return -1;
+			dst[o++] = run + 126;
+			dst[o++] = DC_RLE_SRC(i);
+			i += run;
+			continue;
+		}
+
+		/* Literals up to the next run of at least two bytes */
+		for (lit = 1; i + lit < slen && lit < 128; lit++)
+			if (i + lit + 1 < slen &&
+			    DC_RLE_SRC(i + lit) == DC_RLE_SRC(i + lit + 1))
+				break;
+
+		if (o + 1 + lit > dmax)
+			return -1;
+		dst[o++] = lit - 1;
+		for (; lit; lit--, i++)
+			dst[o++] = DC_RLE_SRC(i);
+	}
+
+#undef DC_RLE_SRC
+
+	return o;
+}
+
+/* Returns the decoded length or -1 on a malformed block */
+static int dc_rle_decode(const unsigned char *src, int slen,
+			 unsigned char *dst, int dmax, int delta)
+{
+	int i = 0, o = 0, n;
+
+	while (i < slen) {
+		unsigned char c = src[i++];
+
+		if (c < 128) {
+			n = c + 1;
+			if (i + n > slen || o + n > dmax)
+				return -1;
+			memcpy(dst + o, src + i, n);
+			i += n;
+		} else {
+			n = c - 126;
+			if (i >= slen || o + n > dmax)
+				return -1;
+			memset(dst + o, src[i++], n);
+		}
+
+		o += n;
+	}
+
+	if (delta)
+		for (i = 1; i < o; i++)
+			dst[i] += dst[i - 1];
+
+	return o;
+}
+
+static int dc_encode(struct dc_dev_t *dev, const unsigned char *src, int slen,
+		     unsigned char *dst, int dmax)
+{
+	unsigned int dlen = dmax;
+
+	switch (dev->codec) {
+	case DC_CODEC_RLE:
+		return dc_rle_encode(src, slen, dst, dmax, 0);
+	case DC_CODEC_DELTA:
+		return dc_rle_encode(src, slen, dst, dmax, 1);
+	case DC_CODEC_LZ4:
+		if (crypto_comp_compress(dev->tfm, src, slen, dst, &dlen))
+			return -1;
+		return dlen;
+	default:
+		return -1;
+	}
+}
+
+static int dc_decode(struct dc_dev_t *dev, unsigned int codec,
+		     const unsigned char *src, int slen,
+		     unsigned char *dst, int dmax)
+{
+	unsigned int dlen = dmax;
+
+	switch (codec) {
+	case DC_CODEC_NONE:
+		if (slen > dmax)
+			return -1;
+		memcpy(dst, src, slen);
+		return slen;
+	case DC_CODEC_RLE:
+		return dc_rle_decode(src, slen, dst, dmax, 0);
+	case DC_CODEC_DELTA:
+		return dc_rle_decode(src, slen, dst, dmax, 1);
+	case DC_CODEC_LZ4:
+		if (!dev->rx_tfm) {
+			printk_ratelimited(KERN_ALERT "mango_dc: dc#%d got an lz4 block, but has no lz4 decoder\n",
+					   dev->ch);
+			return -1;
+		}
+		if (crypto_comp_decompress(dev->rx_tfm, src, slen, dst, &dlen))
+			return -1;
+		return dlen;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Read one coded block from Mango and decode it into the ring. Blocks are
+ * decoded by their own codec byte, so the peer may use any codec.
+ */
+static int dc_rx_codec(struct dc_dev_t *dev)
+{
+	unsigned char *rec = dev->rx_buf, *data = dev->codec_out;
+	int count, raw_len, len, space, lost = 0;
+
+	count = dc_hvc_read(dev, rec, DC_BUFFER_SIZE);
+	if (!count)
+		return 0;
+
+	raw_len = (count < DC_CODEC_HDR_SIZE) ? -1 : rec[1] | (rec[2] << 8);
+	len = (raw_len < 0) ? -1 :
+		dc_decode(dev, rec[0], rec + DC_CODEC_HDR_SIZE,
+			  count - DC_CODEC_HDR_SIZE, dev->codec_out,
+			  DC_CODEC_BLOCK);
+
+	spin_lock(&dev->lock);
+
+	if (len < 0 || len != raw_len) {
+		dev->rx_dropped++;
+	} else {
+		/* Codecs need a ring of a whole block, keep its tail otherwise */
+		if (len > dev->buff.size) {
+			lost  = len - dev->buff.size;
+			data += lost;
+			len   = dev->buff.size;
+		}
+		space = RING_BUFFER_FREE(dev->buff);
+		if (len > space)
+			lost += len - space;
+		dev->rx_overwritten += lost;
+		dc_ring_put(dev, data, len);
+	}
+
+	trace_mango_dc_rx(dev->ch, count, RING_BUFFER_FILL(dev->buff), lost);
+
+	spin_unlock(&dev->lock);
+
+	return count;
+}
+
+/*
+ * Read stream data from Mango straight into the ring tail. At most the
+ * contiguous part up to the end of the buffer is read at once.
+ */
+static int dc_rx_stream(struct dc_dev_t *dev)
+{
+	int tail, count, space, lost = 0;
+
+	spin_lock(&dev->lock);
+
+	/* Rewind an empty ring to get the largest contiguous span */
+	if (!RING_BUFFER_FILL(dev->buff))
+		dev->buff.start = 0;
+
+	tail  = RING_BUFFER_TAIL(dev->buff);
+	space = RING_BUFFER_FREE(dev->buff);
+	count = dc_hvc_read(dev, &dev->buff.buf[tail], dev->buff.size - tail);
+
+	if (count > space) {
+		lost = count - space;
+		dev->rx_overwritten += lost;
+	}
+
+	RING_BUFFER_COMMIT(dev->buff, count);
+
+	trace_mango_dc_rx(dev->ch, count, RING_BUFFER_FILL(dev->buff), lost);
+
+	spin_unlock(&dev->lock);
+
+	return count;
+}
+
+/* Read one record from Mango, rx_buf is protected by drain_lock */
+static int dc_rx_msg(struct dc_dev_t *dev)
 {
+	unsigned long dropped;
 	int count;
-	unsigned char buf[DC_BUFFER_SIZE];
+
+	count = dc_hvc_read(dev, dev->rx_buf, DC_BUFFER_SIZE);
+	if (count) {
+		spin_lock(&dev->lock);
+		dropped = dev->rx_dropped;
+		dc_push_msg(dev, dev->rx_buf, count);
+		trace_mango_dc_rx(dev->ch, count, RING_BUFFER_FILL(dev->buff),
+				  dev->rx_dropped - dropped);
+		spin_unlock(&dev->lock);
+	}
+
+	return count;
+}
+
+/*
+ * Pass received data to the in-kernel client. The client owns the channel,
+ * so the whole ring buffer storage serves as one contiguous span.
+ */
+static int dc_rx_client(struct dc_dev_t *dev, struct mango_dc_client *client)
+{
+	unsigned char *buf = dev->buff.buf;
+	int count, size = dev->buff.size;
+
+	if (dev->mode == MANGO_DC_MODE_MESSAGE) {
+		buf  = dev->rx_buf;
+		size = DC_BUFFER_SIZE;
+	}
+
+	count = dc_hvc_read(dev, buf, size);
+	if (count) {
+		trace_mango_dc_rx(dev->ch, count, 0, 0);
+		client->ops->rx(client->priv, buf, count);
+	}
+
+	return count;
+}
+
+/* Read once from Mango, called with drain_lock held */
+static int dc_rx_one(struct dc_dev_t *dev, struct mango_dc_client *client)
+{
+	if (client)
+		return dc_rx_client(dev, client);
+	else if (dev->codec)
+		return dc_rx_codec(dev);
+	else if (dev->mode == MANGO_DC_MODE_MESSAGE)
+		return dc_rx_msg(dev);
+	else
+		return dc_rx_stream(dev);
+}
+
+/* Remember when unread data arrived, for the RT latency histogram */
+static void dc_rx_stamp(struct dc_dev_t *dev)
+{
+	atomic64_cmpxchg(&dev->rx_stamp, 0, ktime_to_ns(ktime_get()));
+}
+
+/*
+ * Hard IRQ handler. The line stays masked (IRQF_ONESHOT) until the thread
+ * has drained the channel, so nothing else is done here.
+ */
+static irqreturn_t dc_mango_irq(int irq, void *data)
+{
 	struct dc_dev_t *dev = data;
 
-	spin_lock(&dev->lock);
+	trace_mango_dc_irq(dev->ch);
+	mango_capture(&dc_capture_hook, MANGO_CAP_DC_IRQ, dev->ch, NULL, 0);
+
+	if (dev->rt)
+		dc_rx_stamp(dev);
+
+	return IRQ_WAKE_THREAD;
+}
+
+/*
+ * Drain the channel in rounds of DC_RX_BUDGET bytes. Readers are woken up
+ * and the thread may be preempted between the rounds, so a flood does not
+ * monopolize the CPU. In RT mode a round is a single staging buffer, so
+ * readers get the first data and higher priority tasks get the CPU with
+ * bounded delay.
+ */
+static irqreturn_t dc_mango_irq_thread(int irq, void *data)
+{
+	struct dc_dev_t *dev = data;
+	struct mango_dc_client *client = ACCESS_ONCE(dev->client);
+	int budget = dev->rt ? DC_RT_BUDGET : DC_RX_BUDGET;
+	int count, work, total = 0;
 
 	do {
-		count = mango_dc_read(dev->ch, buf, DC_BUFFER_SIZE);
-		if (count) {
-			int i;
+		work = 0;
+
+		mutex_lock(&dev->drain_lock);
+		do {
+			count = dc_rx_one(dev, client);
+			work += count;
+		} while (count && work < budget);
+		mutex_unlock(&dev->drain_lock);
 
-			for (i = 0; i < count; i++)
-				RING_BUFFER_PUSH(dev->buff, buf[i]);
+		if (work) {
+			trace_mango_dc_wakeup(dev->ch, RING_BUFFER_FILL(dev->buff));
+			wake_up_interruptible(&dev->wq);
 		}
-	} while (count);
 
-	spin_unlock(&dev->lock);
+		total += work;
+
+		cond_resched();
+	} while (count);
 
-	wake_up_interruptible(&dev->wq);
+	trace_mango_dc_irq_exit(dev->ch, total);
 
 	return IRQ_HANDLED;
 }
 
-static int dc_open(struct inode *inode, struct file *filep)
+/* Look up a channel, called with dc_devs_lock held */
+static struct dc_dev_t *dc_find(int ch)
 {
 	struct dc_dev_t *dev;
-	int minor;
 
-	minor = iminor(inode);
+	list_for_each_entry(dev, &dc_devs_list, list)
+		if (dev->ch == ch)
+			return dev;
+
+	return NULL;
+}
 
-	list_for_each_entry(dev, &dc_devs_list, list) {
-		if (dev->ch == minor) {
-			if (dev->is_open)
-				return -EBUSY;
+static int dc_open(struct inode *inode, struct file *filep)
+{
+	struct dc_dev_t *dev;
+	int ret = 0;
 
-			dev->is_open = 1;
-			filep->private_data = dev;
+	mutex_lock(&dc_devs_lock);
 
-			printk("dc%d: data channel openned\n", minor);
+	dev = dc_find(iminor(inode));
+	if (!dev) {
+		ret = -ENODEV;
+		goto out;
+	}
 
-			return 0;
-		}
+	if (dev->is_open) {
+		ret = -EBUSY;
+		goto out;
 	}
 
-	return -ENODEV;
+	dev->is_open = 1;
+	filep->private_data = dev;
+
+out:
+	mutex_unlock(&dc_devs_lock);
+
+	return ret;
 }
 
 static int dc_release(struct inode *inode, struct file *filep)
 {
 	struct dc_dev_t *dev = filep->private_data;
 
+	mutex_lock(&dc_devs_lock);
 	dev->is_open = 0;
+	mutex_unlock(&dc_devs_lock);
 
 	return 0;
 }
 
-static ssize_t dc_read(struct file *filep,
-		       char *buffer,
-		       size_t length,
-		       loff_t *offset)
+static int dc_has_data(struct dc_dev_t *dev)
 {
-	struct dc_dev_t *dev = filep->private_data;
-	ssize_t bytes_read = 0;
+	if (dev->mode == MANGO_DC_MODE_MESSAGE)
+		return dev->nr_msgs;
 
-	wait_event_interruptible(dev->wq, RING_BUFFER_FILL(dev->buff));
-
-	while (RING_BUFFER_FILL(dev->buff) && length) {
-		put_user(RING_BUFFER_POP(dev->buff), buffer++);
-		bytes_read++;
-		length--;
-	}
-
-	return bytes_read;
+	return RING_BUFFER_FILL(dev->buff);
 }
 
-static ssize_t dc_write(struct file *filep,
-			const char *buff,
-			size_t len,
-			loff_t *off)
+/*
+ * RT mode: spin for up to busy_poll_us waiting for data, pulling it from
+ * Mango directly whenever the IRQ thread is not doing so. Meant for readers
+ * on an isolated CPU, which then never sleep on the wait queue.
+ */
+static void dc_busy_poll(struct dc_dev_t *dev)
 {
-	struct dc_dev_t *dev = filep->private_data;
-	size_t size = (len > DC_BUFFER_SIZE) ? DC_BUFFER_SIZE : len;
-	size_t count;
+	u64 end = local_clock() + (u64)dev->busy_poll_us * NSEC_PER_USEC;
+
+	while (!dc_has_data(dev)) {
+		if (!ACCESS_ONCE(dev->client) && mutex_trylock(&dev->drain_lock)) {
+			if (dc_rx_one(dev, NULL))
+				dc_rx_stamp(dev);
+			mutex_unlock(&dev->drain_lock);
+		}
 
-	count = mango_dc_write(dev->ch, buff, size);
+		if (signal_pending(current) || need_resched() ||
+		    local_clock() > end)
+			return;
 
-	return count;	
+		cpu_relax();
+	}
 }
 
-static struct file_operations dc_fops = {
-	.read    = dc_read,
-	.write   = dc_write,
-	.open    = dc_open,
-	.release = dc_release
-};
-
-void dc_module_exit(void)
+/*
+ * Account the latency from the arrival of the oldest unread data to its
+ * read, called with rx_lock held. The stamp is kept while data is left in
+ * the ring, so partial reads give an upper bound.
+ */
+static void dc_latency_record(struct dc_dev_t *dev, int empty)
 {
-	struct dc_dev_t *dev, *tmp;
+	s64 stamp = atomic64_read(&dev->rx_stamp);
+	u64 us;
+	int bucket;
 
-	list_for_each_entry_safe(dev, tmp, &dc_devs_list, list) {
-		mango_dc_close(dev->ch);
+	if (!stamp)
+		return;
 
-		disable_irq(dev->irq);
-		free_irq(dev->irq, (void*)dev);
-		unregister_chrdev(dev->major, DEVICE_NAME);
-		device_destroy(class_dc, MKDEV(dev->major, dev->ch));
+	if (empty)
+		atomic64_cmpxchg(&dev->rx_stamp, stamp, 0);
 
-		list_del(&dev->list);
-		kfree(dev);
-	}
+	us = div_u64(ktime_to_ns(ktime_get()) - stamp, NSEC_PER_USEC);
+	bucket = min(fls64(us), DC_LAT_BUCKETS - 1);
 
-	class_destroy(class_dc);
+	dev->lat_hist[bucket]++;
+	if (us > dev->lat_max)
+		dev->lat_max = us;
 }
 
-int dc_module_init(void)
+static ssize_t dc_read(struct file *filep,
+		       char *buffer,
+		       size_t length,
+		       loff_t *offset)
 {
-	int i, ret;
-	struct dc_dev_t *dev;
-	void *ptr_err;
+	struct dc_dev_t *dev = filep->private_data;
+	unsigned char buf[DC_BUFFER_SIZE];
+	int len = (length > DC_BUFFER_SIZE) ? DC_BUFFER_SIZE : length;
+	int count, empty;
 
-	/* Create watchdog device class */
-	class_dc = class_create(THIS_MODULE, CLASS_NAME);
-	if (IS_ERR(ptr_err = class_dc)) {
-		printk(KERN_ALERT "mango_dc: failed to create device class\n");
-		return -EINVAL;
-	}
+	if (dev->rt && dev->busy_poll_us)
+		dc_busy_poll(dev);
 
-	for (i = 0; i < nr_devs; i++) {
-		dev = kmalloc(sizeof(struct dc_dev_t), GFP_KERNEL);
-		if (!dev) {
-			printk(KERN_ALERT "mango_dc: failed to allocated dc#%d\n", i);
-			goto out;
-		}
+	if (wait_event_interruptible(dev->wq, dc_has_data(dev)))
+		return -ERESTARTSYS;
 
-	        ret = register_chrdev(0, DEVICE_NAME, &dc_fops);
-		if (ret < 0) {
-			printk(KERN_ALERT "mango_dc: register data channel device failed with %d\n",
-			       ret);
-			goto out_free;
-		}
+	mutex_lock(&dev->rx_lock);
+	spin_lock(&dev->lock);
+	if (dev->mode == MANGO_DC_MODE_MESSAGE)
+		count = dc_pop_msg(dev, buf, len);
+	else
+		count = dc_pop_stream(dev, buf, len);
+	empty = !dc_has_data(dev);
+	spin_unlock(&dev->lock);
+	if (dev->rt && count)
+		dc_latency_record(dev, empty);
+	mutex_unlock(&dev->rx_lock);
 
-		dev->major   = ret;
-		dev->is_open = 0;
-		dev->dest    = dest_part;
-		dev->irq     = DC_IRQ_NR + i;
-		dev->ch      = i;
-		RING_BUFFER_INIT(dev->buff);
-
-		init_waitqueue_head(&dev->wq);
-		spin_lock_init(&dev->lock);
-
-		dev->dev = device_create(class_dc,
-					 NULL,
-					 MKDEV(dev->major, i),
-					 NULL,
-					 DEVICE_NAME "%d", i);
-		if (IS_ERR(ptr_err = dev->dev)) {
-			printk(KERN_ALERT "mango_wd: failed to create device class\n");
-			goto out_unreg;
-		}
+	/* Truncated record, the rest is lost as for datagram sockets */
+	if (count > len)
+		count = len;
 
-		/* Setup Data Channel interface */
-		ret = request_irq(dev->irq,
-				  dc_mango_irq,
-				  0,
-				  DEVICE_NAME,
-				  (void *)dev);
-		if (ret) {
-			printk(KERN_ALERT "mango_dc: failed to request IRQ for dc#%d\n", dev->ch);
-			goto out_destroy;
-		}
+	trace_mango_dc_read(dev->ch, length, count);
 
-		disable_irq_nosync(dev->irq);
-		enable_irq(dev->irq);
+	if (copy_to_user(buffer, buf, count))
+		return -EFAULT;
 
-		ret = mango_dc_open(dev->ch, dev->dest);
+	return count;
+}
 
-		if (ret) {
-			printk(KERN_ALERT "mango_dc: failed to open mango dc#%d\n", dev->ch);
-			goto out_free_irq;
-		}
+/*
+ * Send one coded block, called with tx_lock held. The largest prefix of
+ * @p up to DC_CODEC_BLOCK bytes which encodes into one record is sent,
+ * falling back to a raw record for incompressible data. Returns the number
+ * of bytes taken, 0 if Mango has no room for the record.
+ */
+static int dc_tx_block(struct dc_dev_t *dev, const unsigned char *p, int len)
+{
+	unsigned char *rec = dev->codec_rec;
+	unsigned int codec = DC_CODEC_NONE;
+	int n, elen = -1;
 
-		printk("mango_dc: dc#%d registered\n", dev->ch);
+	for (n = min(len, DC_CODEC_BLOCK); n > DC_CODEC_PAYLOAD; n /= 2) {
+		elen = dc_encode(dev, p, n, rec + DC_CODEC_HDR_SIZE,
+				 DC_CODEC_PAYLOAD);
+		if (elen >= 0) {
+			codec = dev->codec;
+			break;
+		}
+	}
 
-		list_add(&dev->list, &dc_devs_list);
+	if (elen < 0) {
+		n = elen = min(len, DC_CODEC_PAYLOAD);
+		memcpy(rec + DC_CODEC_HDR_SIZE, p, n);
 	}
 
-	return 0;
+	rec[0] = codec;
+	rec[1] = n & 0xff;
+	rec[2] = n >> 8;
+	elen += DC_CODEC_HDR_SIZE;
 
-out_free_irq:
+	/* Records are atomic, a partial block could not be decoded */
+	if (mango_dc_tx_free_space(dev->ch) < elen ||
+	    dc_hvc_write(dev, rec, elen) != elen)
+		return 0;
+
+	return n;
+}
+
+/*
+ * Send stream data from kernel memory, called with tx_lock held. Returns
+ * the number of bytes taken.
+ */
+static int dc_tx(struct dc_dev_t *dev, const unsigned char *p, int len)
+{
+	int count, done = 0;
+
+	while (done < len) {
+		if (dev->codec)
+			count = dc_tx_block(dev, p + done, len - done);
+		else
+			count = dc_hvc_write(dev, p + done,
+					     min(len - done, DC_BUFFER_SIZE));
+		if (!count)
+			break;
+
+		done += count;
+	}
+
+	return done;
+}
+
+static ssize_t dc_write(struct file *filep,
+			const char *buff,
+			size_t len,
+			loff_t *off)
+{
+	struct dc_dev_t *dev = filep->private_data;
+	size_t size = (len > DC_BUFFER_SIZE) ? DC_BUFFER_SIZE : len;
+	ssize_t count;
+
+	if (dev->mode == MANGO_DC_MODE_MESSAGE && len > MANGO_DC_MSG_MAX)
+		return -EMSGSIZE;
+
+	mutex_lock(&dev->tx_lock);
+
+	/* Coded channels encode up to a whole block per hypercall */
+	if (dev->codec) {
+		size = min_t(size_t, len, DC_CODEC_BLOCK);
+		if (copy_from_user(dev->codec_raw, buff, size))
+			count = -EFAULT;
+		else if (!(count = dc_tx_block(dev, dev->codec_raw, size)))
+			count = -EAGAIN;
+		goto out;
+	}
+
+	/* Stage the data, Mango must never see a faulting user address */
+	if (copy_from_user(dev->tx_buf, buff, size)) {
+		count = -EFAULT;
+		goto out;
+	}
+
+	/* A record is either accepted as a whole or not at all */
+	if (dev->mode == MANGO_DC_MODE_MESSAGE &&
+	    mango_dc_tx_free_space(dev->ch) < size) {
+		count = -EAGAIN;
+		goto out;
+	}
+
+	count = dc_hvc_write(dev, dev->tx_buf, size);
+
+out:
+	mutex_unlock(&dev->tx_lock);
+
+	trace_mango_dc_write(dev->ch, len, count);
+
+	return count;
+}
+
+static int dc_set_mode(struct dc_dev_t *dev, unsigned int mode)
+{
+	int ret = 0;
+
+	if (mode != MANGO_DC_MODE_STREAM && mode != MANGO_DC_MODE_MESSAGE)
+		return -EINVAL;
+
+	mutex_lock(&dev->tx_lock);
+
+	/* Coded channels carry a byte stream */
+	if (dev->codec && mode != MANGO_DC_MODE_STREAM) {
+		mutex_unlock(&dev->tx_lock);
+		return -EBUSY;
+	}
+
+	/* A running drain must not store data in the old framing */
+	mutex_lock(&dev->rx_lock);
+	mutex_lock(&dev->drain_lock);
+	spin_lock(&dev->lock);
+
+	/* Buffered data has no meaning in the other framing */
+	RING_BUFFER_RESET(dev->buff);
+	dev->nr_msgs = 0;
+
+	if (mango_dc_set_mode(dev->ch, mode))
+		ret = -EIO;
+	else
+		dev->mode = mode;
+
+	spin_unlock(&dev->lock);
+	mutex_unlock(&dev->drain_lock);
+	mutex_unlock(&dev->rx_lock);
+	mutex_unlock(&dev->tx_lock);
+
+	return ret;
+}
+
+/*
+ * Send a batch of messages. Mango is asked for the free space once, stream
+ * data is coalesced into as few writes as the staging buffer allows, and in
+ * message mode every record costs exactly one write. The batch stops at the
+ * first message which does not fit completely.
+ */
+static int dc_sendmmsg(struct dc_dev_t *dev, struct mango_dc_mmsg *mmsg)
+{
+	struct mango_dc_msg __user *umsg = dc_user_ptr(mmsg->msgs);
+	struct mango_dc_msg msg;
+	unsigned int space, fill = 0, pending = 0;
+	int i, ret = 0;
+
+	mmsg->count = 0;
+
+	mutex_lock(&dev->tx_lock);
+
+	space = mango_dc_tx_free_space(dev->ch);
+
+	for (i = 0; i < mmsg->vlen; i++) {
+		if (copy_from_user(&msg, &umsg[i], sizeof(msg))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (msg.len > MANGO_DC_MSG_MAX) {
+			ret = -EMSGSIZE;
+			break;
+		}
+
+		if (msg.len > space)
+			break;
+
+		/* Flush the coalesced stream data to make room */
+		if (fill + msg.len > DC_BUFFER_SIZE) {
+			if (dc_tx(dev, dev->tx_buf, fill) != fill) {
+				ret = -EIO;
+				break;
+			}
+			mmsg->count += pending;
+			fill = pending = 0;
+		}
+
+		if (copy_from_user(dev->tx_buf + fill, dc_user_ptr(msg.buf),
+				   msg.len)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		space -= msg.len;
+
+		if (dev->mode == MANGO_DC_MODE_MESSAGE) {
+			if (dc_hvc_write(dev, dev->tx_buf, msg.len) != msg.len) {
+				ret = -EIO;
+				break;
+			}
+			mmsg->count++;
+		} else {
+			fill += msg.len;
+			pending++;
+		}
+	}
+
+	if (fill) {
+		if (dc_tx(dev, dev->tx_buf, fill) == fill)
+			mmsg->count += pending;
+		else if (!ret)
+			ret = -EIO;
+	}
+
+	mutex_unlock(&dev->tx_lock);
+
+	/* Partial batches report success like sendmmsg() */
+	return mmsg->count ? 0 : ret;
+}
+
+/*
+ * Receive up to vlen records, waiting for at least min_count of them unless
+ * the timeout expires first. Only meaningful in message mode.
+ */
+static int dc_recvmmsg(struct dc_dev_t *dev, struct mango_dc_mmsg *mmsg)
+{
+	struct mango_dc_msg __user *umsg = dc_user_ptr(mmsg->msgs);
+	struct mango_dc_msg msg;
+	unsigned char buf[MANGO_DC_MSG_MAX];
+	unsigned int min_count = mmsg->min_count;
+	long ret;
+	int i, size, empty;
+
+	mmsg->count = 0;
+
+	if (dev->mode != MANGO_DC_MODE_MESSAGE)
+		return -EINVAL;
+
+	if (min_count < 1)
+		min_count = 1;
+	if (min_count > mmsg->vlen)
+		min_count = mmsg->vlen;
+
+	/* More records than the ring can hold would never arrive */
+	if (min_count > dev->buff.size / (DC_MSG_HDR_SIZE + 1))
+		min_count = dev->buff.size / (DC_MSG_HDR_SIZE + 1);
+
+	if (mmsg->timeout_ms < 0) {
+		ret = wait_event_interruptible(dev->wq,
+					       dev->nr_msgs >= min_count);
+		if (ret)
+			return ret;
+	} else if (mmsg->timeout_ms > 0) {
+		ret = wait_event_interruptible_timeout(dev->wq,
+					dev->nr_msgs >= min_count,
+					msecs_to_jiffies(mmsg->timeout_ms));
+		if (ret < 0)
+			return ret;
+	}
+
+	for (i = 0; i < mmsg->vlen; i++) {
+		if (copy_from_user(&msg, &umsg[i], sizeof(msg)))
+			return mmsg->count ? 0 : -EFAULT;
+
+		mutex_lock(&dev->rx_lock);
+		spin_lock(&dev->lock);
+		size = dc_pop_msg(dev, buf, sizeof(buf));
+		empty = !dc_has_data(dev);
+		spin_unlock(&dev->lock);
+		if (dev->rt && size)
+			dc_latency_record(dev, empty);
+		mutex_unlock(&dev->rx_lock);
+
+		if (!size)
+			break;
+
+		msg.flags = 0;
+		if (size > msg.len)
+			msg.flags |= MANGO_DC_MSG_TRUNC;
+		else
+			msg.len = size;
+
+		/* The record is gone, report what was delivered so far */
+		if (copy_to_user(dc_user_ptr(msg.buf), buf, msg.len) ||
+		    copy_to_user(&umsg[i], &msg, sizeof(msg)))
+			return mmsg->count ? 0 : -EFAULT;
+
+		mmsg->count++;
+	}
+
+	return mmsg->count ? 0 : -EAGAIN;
+}
+
+static int dc_ioctl_mmsg(struct dc_dev_t *dev, unsigned int cmd,
+			 struct mango_dc_mmsg __user *argp)
+{
+	struct mango_dc_mmsg mmsg;
+	int ret;
+
+	if (copy_from_user(&mmsg, argp, sizeof(mmsg)))
+		return -EFAULT;
+
+	if (mmsg.vlen > MANGO_DC_MMSG_MAX)
+		mmsg.vlen = MANGO_DC_MMSG_MAX;
+
+	if (cmd == MANGO_DC_SENDMMSG)
+		ret = dc_sendmmsg(dev, &mmsg);
+	else
+		ret = dc_recvmmsg(dev, &mmsg);
+
+	if (put_user(mmsg.count, &argp->count))
+		return -EFAULT;
+
+	return ret;
+}
+
+static long dc_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	struct dc_dev_t *dev = filep->private_data;
+	unsigned int __user *argp = (unsigned int __user *)arg;
+	unsigned int mode;
+
+	switch (cmd) {
+	case MANGO_DC_SET_MODE:
+		if (get_user(mode, argp))
+			return -EFAULT;
+		return dc_set_mode(dev, mode);
+	case MANGO_DC_GET_MODE:
+		return put_user(dev->mode, argp);
+	case MANGO_DC_GET_CPU:
+		return put_user(dev->cpu, (int __user *)argp);
+	case MANGO_DC_SENDMMSG:
+	case MANGO_DC_RECVMMSG:
+		return dc_ioctl_mmsg(dev, cmd, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct pipe_buf_operations dc_pipe_buf_ops = {
+	.can_merge = 0,
+	.confirm   = generic_pipe_buf_confirm,
+	.release   = generic_pipe_buf_release,
+	.steal     = generic_pipe_buf_steal,
+	.get       = generic_pipe_buf_get,
+};
+
+static void dc_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/*
+ * Move stream data to a pipe in page sized chunks. The data is copied once
+ * from the ring buffer into fresh pages, which are then handed over to the
+ * pipe. Only the part the pipe accepted is consumed from the ring buffer.
+ */
+static ssize_t dc_splice_read(struct file *filep,
+			      loff_t *ppos,
+			      struct pipe_inode_info *pipe,
+			      size_t len,
+			      unsigned int flags)
+{
+	struct dc_dev_t *dev = filep->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages        = pages,
+		.partial      = partial,
+		.nr_pages     = 0,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags        = flags,
+		.ops          = &dc_pipe_buf_ops,
+		.spd_release  = dc_spd_release,
+	};
+	unsigned long overwritten;
+	int offset = 0, count, i, nr_pages;
+	ssize_t ret;
+
+	if (dev->mode != MANGO_DC_MODE_STREAM)
+		return -EINVAL;
+
+	if (!RING_BUFFER_FILL(dev->buff)) {
+		if ((flags & SPLICE_F_NONBLOCK) || (filep->f_flags & O_NONBLOCK))
+			return -EAGAIN;
+
+		if (wait_event_interruptible(dev->wq, dc_has_data(dev)))
+			return -ERESTARTSYS;
+	}
+
+	mutex_lock(&dev->rx_lock);
+
+	/* The fill level only grows while rx_lock is held */
+	count = min_t(size_t, len, RING_BUFFER_FILL(dev->buff));
+	nr_pages = min_t(int, DIV_ROUND_UP(count, PAGE_SIZE), PIPE_DEF_BUFFERS);
+
+	for (i = 0; i < nr_pages; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (!pages[i])
+			break;
+	}
+
+	/* Returning 0 would look like the end of the stream */
+	if (!i && count) {
+		mutex_unlock(&dev->rx_lock);
+		return -ENOMEM;
+	}
+	nr_pages = i;
+
+	spin_lock(&dev->lock);
+
+	overwritten = dev->rx_overwritten;
+
+	while (len && spd.nr_pages < nr_pages) {
+		count = min_t(size_t, len, PAGE_SIZE);
+		count = min(count, RING_BUFFER_FILL(dev->buff) - offset);
+		if (count <= 0)
+			break;
+
+		dc_ring_peek(dev, offset, page_address(pages[spd.nr_pages]),
+			     count);
+
+		partial[spd.nr_pages].offset = 0;
+		partial[spd.nr_pages].len = count;
+		spd.nr_pages++;
+
+		offset += count;
+		len -= count;
+	}
+
+	spin_unlock(&dev->lock);
+
+	for (i = spd.nr_pages; i < nr_pages; i++)
+		put_page(pages[i]);
+
+	ret = 0;
+	if (spd.nr_pages)
+		ret = splice_to_pipe(pipe, &spd);
+
+	if (ret > 0) {
+		spin_lock(&dev->lock);
+
+		/* Bytes overwritten meanwhile were the oldest ones we copied */
+		count = ret - min_t(unsigned long, ret,
+				    dev->rx_overwritten - overwritten);
+		count = min(count, RING_BUFFER_FILL(dev->buff));
+		RING_BUFFER_SKIP(dev->buff, count);
+
+		spin_unlock(&dev->lock);
+	}
+
+	mutex_unlock(&dev->rx_lock);
+
+	return ret;
+}
+
+/*
+ * Pipe pages are passed to Mango directly, no staging copy is needed. Mango
+ * does not signal free space, so a full channel is retried on the next tick
+ * unless the caller asked not to block.
+ */
+static int dc_splice_actor(struct pipe_inode_info *pipe,
+			   struct pipe_buffer *buf,
+			   struct splice_desc *sd)
+{
+	struct dc_dev_t *dev = sd->u.file->private_data;
+	unsigned char *data;
+	int ret;
+
+	ret = buf->ops->confirm(pipe, buf);
+	if (ret)
+		return ret;
+
+	data = kmap(buf->page);
+
+	for (;;) {
+		mutex_lock(&dev->tx_lock);
+		ret = dc_tx(dev, data + buf->offset, sd->len);
+		mutex_unlock(&dev->tx_lock);
+
+		if (ret)
+			break;
+
+		if ((sd->flags & SPLICE_F_NONBLOCK) ||
+		    (sd->u.file->f_flags & O_NONBLOCK)) {
+			ret = -EAGAIN;
+			break;
+		}
+
+		if (schedule_timeout_interruptible(1) || signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+	}
+
+	kunmap(buf->page);
+
+	return ret;
+}
+
+static ssize_t dc_splice_write(struct pipe_inode_info *pipe,
+			       struct file *filep,
+			       loff_t *ppos,
+			       size_t len,
+			       unsigned int flags)
+{
+	struct dc_dev_t *dev = filep->private_data;
+
+	if (dev->mode != MANGO_DC_MODE_STREAM)
+		return -EINVAL;
+
+	return splice_from_pipe(pipe, filep, ppos, len, flags, dc_splice_actor);
+}
+
+static struct file_operations dc_fops = {
+	.read           = dc_read,
+	.write          = dc_write,
+	.splice_read    = dc_splice_read,
+	.splice_write   = dc_splice_write,
+	.unlocked_ioctl = dc_ioctl,
+	.open           = dc_open,
+	.release        = dc_release
+};
+
+/*
+ * Send queued client requests straight from the client buffers. A request
+ * which Mango cannot take yet is retried on the next tick.
+ */
+static void dc_tx_work(struct work_struct *work)
+{
+	struct dc_dev_t *dev = container_of(to_delayed_work(work),
+					    struct dc_dev_t, tx_work);
+	struct mango_dc_txbuf *tx;
+	unsigned int count;
+
+	mutex_lock(&dev->tx_lock);
+	spin_lock_bh(&dev->tx_queue_lock);
+
+	while (!list_empty(&dev->tx_queue)) {
+		tx = list_first_entry(&dev->tx_queue, struct mango_dc_txbuf, list);
+		spin_unlock_bh(&dev->tx_queue_lock);
+
+		if (dev->mode == MANGO_DC_MODE_MESSAGE) {
+			if (mango_dc_tx_free_space(dev->ch) < tx->len)
+				goto retry;
+			count = dc_hvc_write(dev, tx->data, tx->len);
+			tx->status = (count == tx->len) ? 0 : -EIO;
+			tx->sent = count;
+		} else {
+			tx->sent += dc_tx(dev, tx->data + tx->sent,
+					  tx->len - tx->sent);
+			if (tx->sent < tx->len)
+				goto retry;
+			tx->status = 0;
+		}
+
+		spin_lock_bh(&dev->tx_queue_lock);
+		list_del(&tx->list);
+		spin_unlock_bh(&dev->tx_queue_lock);
+
+		tx->done(tx);
+
+		spin_lock_bh(&dev->tx_queue_lock);
+	}
+
+	spin_unlock_bh(&dev->tx_queue_lock);
+	mutex_unlock(&dev->tx_lock);
+
+	return;
+
+retry:
+	mutex_unlock(&dev->tx_lock);
+	schedule_delayed_work(&dev->tx_work, 1);
+}
+
+/* Stop sending client requests and move the queued ones to @list */
+static void dc_tx_take(struct dc_dev_t *dev, struct list_head *list)
+{
+	cancel_delayed_work_sync(&dev->tx_work);
+
+	spin_lock_bh(&dev->tx_queue_lock);
+	list_splice_init(&dev->tx_queue, list);
+	spin_unlock_bh(&dev->tx_queue_lock);
+}
+
+static void dc_tx_cancel(struct list_head *list)
+{
+	struct mango_dc_txbuf *tx, *tmp;
+
+	list_for_each_entry_safe(tx, tmp, list, list) {
+		list_del(&tx->list);
+		tx->status = -ECANCELED;
+		tx->done(tx);
+	}
+}
+
+/* Complete the requests which were never sent */
+static void dc_tx_flush(struct dc_dev_t *dev)
+{
+	LIST_HEAD(list);
+
+	dc_tx_take(dev, &list);
+	dc_tx_cancel(&list);
+}
+
+/*
+ * Reset the channel in place, e.g. after its peer partition restarted. The
+ * open file, the ring buffer and the IRQ are kept. With @flush the data
+ * queued in both directions is discarded, otherwise readers still get what
+ * arrived before the reset and client requests are sent afterwards.
+ */
+static int dc_recover(struct dc_dev_t *dev, unsigned int flush)
+{
+	ktime_t start = ktime_get();
+	unsigned int mode;
+	int ret = 0;
+	u64 us;
+
+	if (flush)
+		dc_tx_flush(dev);
+	else
+		cancel_delayed_work_sync(&dev->tx_work);
+
+	mutex_lock(&dev->tx_lock);
+	mutex_lock(&dev->rx_lock);
+
+	/* The IRQ thread takes drain_lock, let it finish first */
+	disable_irq(dev->irq);
+	mutex_lock(&dev->drain_lock);
+
+	if (mango_dc_reset(dev->ch)) {
+		mango_dc_close(dev->ch);
+		if (mango_dc_open(dev->ch, dev->dest))
+			ret = -EIO;
+	}
+
+	/* The channel comes back in stream mode, coded channels use records */
+	mode = dev->codec ? MANGO_DC_MODE_MESSAGE : dev->mode;
+	if (!ret && mode != MANGO_DC_MODE_STREAM && mango_dc_set_mode(dev->ch, mode))
+		ret = -EIO;
+
+	spin_lock(&dev->lock);
+
+	if (flush) {
+		RING_BUFFER_RESET(dev->buff);
+		dev->nr_msgs = 0;
+		atomic64_set(&dev->rx_stamp, 0);
+	}
+
+	if (!ret) {
+		us = ktime_us_delta(ktime_get(), start);
+		dev->resets++;
+		dev->reset_last_us = us;
+		if (us > dev->reset_max_us)
+			dev->reset_max_us = us;
+	}
+
+	spin_unlock(&dev->lock);
+
+	mutex_unlock(&dev->drain_lock);
+	enable_irq(dev->irq);
+	mutex_unlock(&dev->rx_lock);
+	mutex_unlock(&dev->tx_lock);
+
+	if (ret)
+		printk(KERN_ALERT "mango_dc: failed to reset dc#%d\n", dev->ch);
+
+	if (!flush)
+		schedule_delayed_work(&dev->tx_work, 0);
+
+	return ret;
+}
+
+static void dc_reset_work(struct work_struct *work)
+{
+	struct dc_dev_t *dev = container_of(work, struct dc_dev_t, reset_work);
+
+	dc_recover(dev, dev->reset_flush);
+}
+
+/*
+ * Attach an in-kernel consumer to a channel. While attached, the channel
+ * cannot be opened from user space and all received data goes to ops->rx.
+ */
+struct mango_dc_client *mango_dc_attach(int ch,
+					const struct mango_dc_client_ops *ops,
+					void *priv)
+{
+	struct mango_dc_client *client;
+	struct dc_dev_t *dev;
+	int ret = 0;
+
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client)
+		return ERR_PTR(-ENOMEM);
+
+	client->ops  = ops;
+	client->priv = priv;
+
+	mutex_lock(&dc_devs_lock);
+
+	dev = dc_find(ch);
+	if (!dev)
+		ret = -ENODEV;
+	else if (dev->is_open || dev->codec || dev->groups)
+		ret = -EBUSY;
+
+	if (!ret) {
+		dev->is_open = 1;
+		client->dev  = dev;
+
+		/* Data queued for readers is not meant for the client */
+		spin_lock(&dev->lock);
+		RING_BUFFER_RESET(dev->buff);
+		dev->nr_msgs = 0;
+		dev->client  = client;
+		spin_unlock(&dev->lock);
+	}
+
+	mutex_unlock(&dc_devs_lock);
+
+	if (ret) {
+		kfree(client);
+		return ERR_PTR(ret);
+	}
+
+	return client;
+}
+EXPORT_SYMBOL(mango_dc_attach);
+
+void mango_dc_detach(struct mango_dc_client *client)
+{
+	struct dc_dev_t *dev = client->dev;
+	LIST_HEAD(list);
+
+	mutex_lock(&dc_devs_lock);
+
+	dev->client = NULL;
+
+	/* Wait for the IRQ thread to drop its reference */
+	synchronize_irq(dev->irq);
+
+	dc_tx_take(dev, &list);
+	dev->is_open = 0;
+
+	mutex_unlock(&dc_devs_lock);
+
+	/* The callbacks may take locks of their own, run them unlocked */
+	dc_tx_cancel(&list);
+
+	kfree(client);
+}
+EXPORT_SYMBOL(mango_dc_detach);
+
+/* Queue a transmit request, tx->done() is called once it was sent */
+int mango_dc_submit(struct mango_dc_client *client, struct mango_dc_txbuf *tx)
+{
+	struct dc_dev_t *dev = client->dev;
+
+	if (dev->mode == MANGO_DC_MODE_MESSAGE && tx->len > MANGO_DC_MSG_MAX)
+		return -EMSGSIZE;
+
+	tx->sent   = 0;
+	tx->status = 0;
+
+	spin_lock_bh(&dev->tx_queue_lock);
+	list_add_tail(&tx->list, &dev->tx_queue);
+	spin_unlock_bh(&dev->tx_queue_lock);
+
+	schedule_delayed_work(&dev->tx_work, 0);
+
+	return 0;
+}
+EXPORT_SYMBOL(mango_dc_submit);
+
+int mango_dc_client_set_mode(struct mango_dc_client *client, unsigned int mode)
+{
+	return dc_set_mode(client->dev, mode);
+}
+EXPORT_SYMBOL(mango_dc_client_set_mode);
+
+/* Partition the channel is bound to */
+int mango_dc_client_get_dest(struct mango_dc_client *client)
+{
+	return client->dev->dest;
+}
+EXPORT_SYMBOL(mango_dc_client_get_dest);
+
+/* Install or remove (NULL) the capture hook, waits for running calls */
+void mango_dc_set_capture(mango_capture_fn fn)
+{
+	rcu_assign_pointer(dc_capture_hook, fn);
+	synchronize_sched();
+}
+EXPORT_SYMBOL(mango_dc_set_capture);
+
+static const char *dc_mode_names[] = {
+	[MANGO_DC_MODE_STREAM]  = "stream",
+	[MANGO_DC_MODE_MESSAGE] = "message",
+};
+
+static ssize_t dc_dest_show(struct device *d,
+			    struct device_attribute *attr,
+			    char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%d\n", dev->dest);
+}
+
+static ssize_t dc_irq_show(struct device *d,
+			   struct device_attribute *attr,
+			   char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%d\n", dev->irq);
+}
+
+static ssize_t dc_buffer_size_show(struct device *d,
+				   struct device_attribute *attr,
+				   char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%d\n", dev->buff.size);
+}
+
+static ssize_t dc_mode_show(struct device *d,
+			    struct device_attribute *attr,
+			    char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%s\n", dc_mode_names[dev->mode]);
+}
+
+static ssize_t dc_rx_dropped_show(struct device *d,
+				  struct device_attribute *attr,
+				  char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%lu\n", dev->rx_dropped);
+}
+
+static ssize_t dc_rx_overwritten_show(struct device *d,
+				      struct device_attribute *attr,
+				      char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%lu\n", dev->rx_overwritten);
+}
+
+static ssize_t dc_rt_show(struct device *d,
+			  struct device_attribute *attr,
+			  char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%u\n", dev->rt);
+}
+
+static ssize_t dc_rt_store(struct device *d,
+			   struct device_attribute *attr,
+			   const char *buf,
+			   size_t count)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+	unsigned int rt;
+
+	if (kstrtouint(buf, 0, &rt) || rt > 1)
+		return -EINVAL;
+
+	/* Data which arrived before is not stamped, do not measure it */
+	atomic64_set(&dev->rx_stamp, 0);
+	dev->rt = rt;
+
+	return count;
+}
+
+static ssize_t dc_busy_poll_us_show(struct device *d,
+				    struct device_attribute *attr,
+				    char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%u\n", dev->busy_poll_us);
+}
+
+static ssize_t dc_busy_poll_us_store(struct device *d,
+				     struct device_attribute *attr,
+				     const char *buf,
+				     size_t count)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+	unsigned int us;
+
+	if (kstrtouint(buf, 0, &us))
+		return -EINVAL;
+
+	dev->busy_poll_us = us;
+
+	return count;
+}
+
+/* One line per bucket: lowest latency in us, number of reads */
+static ssize_t dc_latency_show(struct device *d,
+			       struct device_attribute *attr,
+			       char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+	ssize_t len = 0;
+	int i;
+
+	mutex_lock(&dev->rx_lock);
+
+	for (i = 0; i < DC_LAT_BUCKETS; i++)
+		len += sprintf(buf + len, "%lu %lu\n",
+			       i ? 1UL << (i - 1) : 0, dev->lat_hist[i]);
+	len += sprintf(buf + len, "max %llu\n", dev->lat_max);
+
+	mutex_unlock(&dev->rx_lock);
+
+	return len;
+}
+
+/* Any write resets the histogram */
+static ssize_t dc_latency_store(struct device *d,
+				struct device_attribute *attr,
+				const char *buf,
+				size_t count)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+
+	mutex_lock(&dev->rx_lock);
+	memset(dev->lat_hist, 0, sizeof(dev->lat_hist));
+	dev->lat_max = 0;
+	mutex_unlock(&dev->rx_lock);
+
+	return count;
+}
+
+static const char *dc_reset_policy_names[] = {
+	"keep", "flush",
+};
+
+/* echo keep|flush > reset, any other value uses reset_policy */
+static ssize_t dc_reset_store(struct device *d,
+			      struct device_attribute *attr,
+			      const char *buf,
+			      size_t count)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+	unsigned int flush = dev->reset_flush;
+	int ret;
+
+	if (ACCESS_ONCE(dev->dying))
+		return -ENODEV;
+
+	if (sysfs_streq(buf, "keep"))
+		flush = 0;
+	else if (sysfs_streq(buf, "flush"))
+		flush = 1;
+
+	ret = dc_recover(dev, flush);
+
+	return ret ? ret : count;
+}
+
+static ssize_t dc_reset_policy_show(struct device *d,
+				    struct device_attribute *attr,
+				    char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%s\n", dc_reset_policy_names[dev->reset_flush]);
+}
+
+/* Policy for the resets done on hypercall failures */
+static ssize_t dc_reset_policy_store(struct device *d,
+				     struct device_attribute *attr,
+				     const char *buf,
+				     size_t count)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+	unsigned int flush;
+
+	for (flush = 0; flush < ARRAY_SIZE(dc_reset_policy_names); flush++)
+		if (sysfs_streq(buf, dc_reset_policy_names[flush]))
+			break;
+
+	if (flush == ARRAY_SIZE(dc_reset_policy_names))
+		return -EINVAL;
+
+	dev->reset_flush = flush;
+
+	return count;
+}
+
+static ssize_t dc_recovery_show(struct device *d,
+				struct device_attribute *attr,
+				char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+	ssize_t len;
+
+	spin_lock(&dev->lock);
+	len = sprintf(buf, "resets %lu\nlast_us %llu\nmax_us %llu\n",
+		      dev->resets, dev->reset_last_us, dev->reset_max_us);
+	spin_unlock(&dev->lock);
+
+	return len;
+}
+
+static const char *dc_codec_names[DC_CODEC_MAX] = {
+	[DC_CODEC_NONE]  = "none",
+	[DC_CODEC_RLE]   = "rle",
+	[DC_CODEC_DELTA] = "delta",
+	[DC_CODEC_LZ4]   = "lz4",
+};
+
+static ssize_t dc_codec_show(struct device *d,
+			     struct device_attribute *attr,
+			     char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%s\n", dc_codec_names[dev->codec]);
+}
+
+/*
+ * Select the codec for outgoing data. Any codec but "none" switches Mango
+ * to message mode, so every coded block is one record; both ends of the
+ * channel must do so. The ring must hold a decoded block, so channels with
+ * a buffer_size below DC_CODEC_BLOCK stay uncoded. Buffered data is
+ * discarded.
+ */
+static ssize_t dc_codec_store(struct device *d,
+			      struct device_attribute *attr,
+			      const char *buf,
+			      size_t count)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+	struct crypto_comp *tfm = NULL, *rx_tfm = NULL, *old;
+	unsigned int codec, mode;
+	int ret = 0;
+
+	for (codec = 0; codec < DC_CODEC_MAX; codec++)
+		if (sysfs_streq(buf, dc_codec_names[codec]))
+			break;
+
+	if (codec == DC_CODEC_MAX)
+		return -EINVAL;
+
+	/* A decoded block must fit into the ring */
+	if (codec != DC_CODEC_NONE && dev->buff.size < DC_CODEC_BLOCK)
+		return -EINVAL;
+
+	if (codec == DC_CODEC_LZ4) {
+		tfm = crypto_alloc_comp("lz4", 0, 0);
+		if (IS_ERR(tfm))
+			return PTR_ERR(tfm);
+	}
+
+	/* The peer may send lz4 blocks whatever codec is used here */
+	if (codec != DC_CODEC_NONE) {
+		rx_tfm = crypto_alloc_comp("lz4", 0, 0);
+		if (IS_ERR(rx_tfm)) {
+			printk(KERN_ALERT "mango_dc: no lz4 for dc#%d, lz4 blocks will be dropped\n",
+			       dev->ch);
+			rx_tfm = NULL;
+		}
+	}
+
+	mode = codec ? MANGO_DC_MODE_MESSAGE : MANGO_DC_MODE_STREAM;
+
+	mutex_lock(&dev->tx_lock);
+	mutex_lock(&dev->rx_lock);
+	mutex_lock(&dev->drain_lock);
+	spin_lock(&dev->lock);
+
+	/* Group writes are sent as they are, a coded member would drop them */
+	if (dev->client || dev->groups || dev->mode != MANGO_DC_MODE_STREAM) {
+		ret = -EBUSY;
+	} else if (mango_dc_set_mode(dev->ch, mode)) {
+		ret = -EIO;
+	} else {
+		RING_BUFFER_RESET(dev->buff);
+		old = dev->tfm;
+		dev->tfm = tfm;
+		tfm = old;
+		old = dev->rx_tfm;
+		dev->rx_tfm = rx_tfm;
+		rx_tfm = old;
+		dev->codec = codec;
+	}
+
+	spin_unlock(&dev->lock);
+	mutex_unlock(&dev->drain_lock);
+	mutex_unlock(&dev->rx_lock);
+	mutex_unlock(&dev->tx_lock);
+
+	if (tfm)
+		crypto_free_comp(tfm);
+	if (rx_tfm)
+		crypto_free_comp(rx_tfm);
+
+	return ret ? ret : count;
+}
+
+static int dc_node(int cpu)
+{
+	return (cpu < 0) ? NUMA_NO_NODE : cpu_to_node(cpu);
+}
+
+/* Route the IRQ, and so the IRQ thread, to the channel CPU */
+static void dc_set_affinity(struct dc_dev_t *dev)
+{
+	irq_set_affinity_hint(dev->irq,
+			      (dev->cpu < 0) ? NULL : cpumask_of(dev->cpu));
+}
+
+static ssize_t dc_cpu_show(struct device *d,
+			   struct device_attribute *attr,
+			   char *buf)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%d\n", dev->cpu);
+}
+
+/*
+ * Move a channel to another CPU. The ring buffer is reallocated on the node
+ * of the new CPU and the buffered data is carried over.
+ */
+static ssize_t dc_cpu_store(struct device *d,
+			    struct device_attribute *attr,
+			    const char *buf,
+			    size_t count)
+{
+	struct dc_dev_t *dev = dev_get_drvdata(d);
+	unsigned char *data, *old;
+	int cpu, fill;
+
+	if (kstrtoint(buf, 0, &cpu))
+		return -EINVAL;
+
+	if (cpu >= nr_cpu_ids || (cpu >= 0 && !cpu_online(cpu)))
+		return -EINVAL;
+
+	data = kmalloc_node(dev->buff.size, GFP_KERNEL, dc_node(cpu));
+	if (!data)
+		return -ENOMEM;
+
+	spin_lock(&dev->lock);
+
+	old  = dev->buff.buf;
+	fill = RING_BUFFER_FILL(dev->buff);
+	dc_ring_get(dev, data, fill);
+
+	RING_BUFFER_ATTACH(dev->buff, data, dev->buff.size);
+	RING_BUFFER_COMMIT(dev->buff, fill);
+	dev->cpu = cpu;
+
+	spin_unlock(&dev->lock);
+
+	dc_set_affinity(dev);
+
+	/* An attached client is read into the storage without the lock */
+	synchronize_irq(dev->irq);
+	kfree(old);
+
+	return count;
+}
+
+static DEVICE_ATTR(dest, S_IRUGO, dc_dest_show, NULL);
+static DEVICE_ATTR(irq, S_IRUGO, dc_irq_show, NULL);
+static DEVICE_ATTR(buffer_size, S_IRUGO, dc_buffer_size_show, NULL);
+static DEVICE_ATTR(mode, S_IRUGO, dc_mode_show, NULL);
+static DEVICE_ATTR(rx_dropped, S_IRUGO, dc_rx_dropped_show, NULL);
+static DEVICE_ATTR(rx_overwritten, S_IRUGO, dc_rx_overwritten_show, NULL);
+static DEVICE_ATTR(cpu, S_IRUGO | S_IWUSR, dc_cpu_show, dc_cpu_store);
+static DEVICE_ATTR(rt, S_IRUGO | S_IWUSR, dc_rt_show, dc_rt_store);
+static DEVICE_ATTR(busy_poll_us, S_IRUGO | S_IWUSR,
+		   dc_busy_poll_us_show, dc_busy_poll_us_store);
+static DEVICE_ATTR(latency, S_IRUGO | S_IWUSR, dc_latency_show, dc_latency_store);
+static DEVICE_ATTR(codec, S_IRUGO | S_IWUSR, dc_codec_show, dc_codec_store);
+static DEVICE_ATTR(reset, S_IWUSR, NULL, dc_reset_store);
+static DEVICE_ATTR(reset_policy, S_IRUGO | S_IWUSR,
+		   dc_reset_policy_show, dc_reset_policy_store);
+static DEVICE_ATTR(recovery, S_IRUGO, dc_recovery_show, NULL);
+
+static struct attribute *dc_attrs[] = {
+	&dev_attr_dest.attr,
+	&dev_attr_irq.attr,
+	&dev_attr_buffer_size.attr,
+	&dev_attr_mode.attr,
+	&dev_attr_rx_dropped.attr,
+	&dev_attr_rx_overwritten.attr,
+	&dev_attr_cpu.attr,
+	&dev_attr_rt.attr,
+	&dev_attr_busy_poll_us.attr,
+	&dev_attr_latency.attr,
+	&dev_attr_codec.attr,
+	&dev_attr_reset.attr,
+	&dev_attr_reset_policy.attr,
+	&dev_attr_recovery.attr,
+	NULL
+};
+
+static const struct attribute_group dc_attr_group = {
+	.attrs = dc_attrs,
+};
+
+static const struct attribute_group *dc_attr_groups[] = {
+	&dc_attr_group,
+	NULL
+};
+
+/* Tear down a channel, called with dc_devs_lock held */
+static void dc_destroy(struct dc_dev_t *dev)
+{
+	/* No new resets, then wait for the sysfs stores and a running reset */
+	ACCESS_ONCE(dev->dying) = 1;
+	smp_mb();
+	device_destroy(class_dc, MKDEV(MAJOR(dc_devt), dev->ch));
+	cancel_work_sync(&dev->reset_work);
+
+	/* A kept reset may have rescheduled the client requests */
+	dc_tx_flush(dev);
+
+	disable_irq(dev->irq);
+	irq_set_affinity_hint(dev->irq, NULL);
+	free_irq(dev->irq, (void *)dev);
+
+	mango_dc_close(dev->ch);
+	cdev_del(dev->cdev);
+
+	list_del(&dev->list);
+	if (dev->tfm)
+		crypto_free_comp(dev->tfm);
+	if (dev->rx_tfm)
+		crypto_free_comp(dev->rx_tfm);
+	kfree(dev->buff.buf);
+	kfree(dev);
+}
+
+/* Set up a channel, called with dc_devs_lock held */
+static int dc_create(int ch, int dest, int irq, int size, unsigned int mode,
+		     int cpu)
+{
+	struct dc_dev_t *dev;
+	unsigned char *buf;
+	void *ptr_err;
+	int ret;
+
+	if (ch < 0 || ch >= DC_MAX_DEVS || mode >= ARRAY_SIZE(dc_mode_names))
+		return -EINVAL;
+
+	if (size < DC_BUFFER_SIZE || size > DC_BUFFER_SIZE_MAX ||
+	    !is_power_of_2(size))
+		return -EINVAL;
+
+	if (cpu >= nr_cpu_ids || (cpu >= 0 && !cpu_online(cpu)))
+		return -EINVAL;
+
+	if (dc_find(ch))
+		return -EEXIST;
+
+	/* Keep the channel data close to the CPU consuming it */
+	dev = kzalloc_node(sizeof(struct dc_dev_t), GFP_KERNEL, dc_node(cpu));
+	if (!dev) {
+		printk(KERN_ALERT "mango_dc: failed to allocated dc#%d\n", ch);
+		return -ENOMEM;
+	}
+
+	buf = kmalloc_node(size, GFP_KERNEL, dc_node(cpu));
+	if (!buf) {
+		printk(KERN_ALERT "mango_dc: failed to allocated buffer for dc#%d\n", ch);
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	dev->is_open = 0;
+	dev->dest    = dest;
+	dev->irq     = irq;
+	dev->ch      = ch;
+	dev->mode    = mode;
+	dev->cpu     = cpu;
+	RING_BUFFER_ATTACH(dev->buff, buf, size);
+
+	init_waitqueue_head(&dev->wq);
+	spin_lock_init(&dev->lock);
+	mutex_init(&dev->tx_lock);
+	mutex_init(&dev->rx_lock);
+	mutex_init(&dev->drain_lock);
+	spin_lock_init(&dev->tx_queue_lock);
+	INIT_LIST_HEAD(&dev->tx_queue);
+	INIT_DELAYED_WORK(&dev->tx_work, dc_tx_work);
+	INIT_WORK(&dev->reset_work, dc_reset_work);
+
+	dev->cdev = cdev_alloc();
+	if (!dev->cdev) {
+		ret = -ENOMEM;
+		goto out_free_buf;
+	}
+
+	dev->cdev->owner = THIS_MODULE;
+	dev->cdev->ops   = &dc_fops;
+
+	ret = cdev_add(dev->cdev, MKDEV(MAJOR(dc_devt), ch), 1);
+	if (ret) {
+		printk(KERN_ALERT "mango_dc: register data channel device failed with %d\n",
+		       ret);
+		kobject_put(&dev->cdev->kobj);
+		goto out_free_buf;
+	}
+
+	dev->dev = device_create_with_groups(class_dc,
+					     NULL,
+					     MKDEV(MAJOR(dc_devt), ch),
+					     dev,
+					     dc_attr_groups,
+					     DEVICE_NAME "%d", ch);
+	if (IS_ERR(ptr_err = dev->dev)) {
+		printk(KERN_ALERT "mango_dc: failed to create device dc%d\n", ch);
+		ret = PTR_ERR(ptr_err);
+		goto out_cdev;
+	}
+
+	/* Setup Data Channel interface */
+	ret = request_threaded_irq(dev->irq,
+				   dc_mango_irq,
+				   dc_mango_irq_thread,
+				   IRQF_ONESHOT,
+				   DEVICE_NAME,
+				   (void *)dev);
+	if (ret) {
+		printk(KERN_ALERT "mango_dc: failed to request IRQ for dc#%d\n", dev->ch);
+		goto out_destroy;
+	}
+
+	dc_set_affinity(dev);
+
+	disable_irq_nosync(dev->irq);
+	enable_irq(dev->irq);
+
+	ret = mango_dc_open(dev->ch, dev->dest);
+	if (ret) {
+		printk(KERN_ALERT "mango_dc: failed to open mango dc#%d\n", dev->ch);
+		ret = -EIO;
+		goto out_free_irq;
+	}
+
+	if (mode != MANGO_DC_MODE_STREAM && mango_dc_set_mode(dev->ch, mode)) {
+		printk(KERN_ALERT "mango_dc: failed to set mode of dc#%d\n", dev->ch);
+		mango_dc_close(dev->ch);
+		ret = -EIO;
+		goto out_free_irq;
+	}
+
+	printk("mango_dc: dc#%d registered\n", dev->ch);
+
+	list_add(&dev->list, &dc_devs_list);
+
+	return 0;
+
+out_free_irq:
 	disable_irq(dev->irq);
+	irq_set_affinity_hint(dev->irq, NULL);
 	free_irq(dev->irq, (void *)dev);
 out_destroy:
-	device_destroy(class_dc, MKDEV(dev->major, i));
-out_unreg:
-	unregister_chrdev(dev->major, DEVICE_NAME);
+	device_destroy(class_dc, MKDEV(MAJOR(dc_devt), ch));
+out_cdev:
+	cdev_del(dev->cdev);
+out_free_buf:
+	kfree(buf);
 out_free:
 	kfree(dev);
+
+	return ret;
+}
+
+/*
+ * Create a channel at run time:
+ *   echo "<ch> <dest> [<irq> [<buffer_size> [<mode> [<cpu>]]]]" > new_channel
+ */
+static ssize_t dc_new_channel_store(struct class *class,
+				    struct class_attribute *attr,
+				    const char *buf,
+				    size_t count)
+{
+	int ch, dest, irq = -1, size = DC_BUFFER_SIZE, cpu = -1;
+	char mode[16] = "stream";
+	unsigned int i;
+	int ret;
+
+	if (sscanf(buf, "%d %d %d %d %15s %d",
+		   &ch, &dest, &irq, &size, mode, &cpu) < 2)
+		return -EINVAL;
+
+	if (irq < 0)
+		irq = DC_IRQ_NR + ch;
+
+	for (i = 0; i < ARRAY_SIZE(dc_mode_names); i++)
+		if (!strcmp(mode, dc_mode_names[i]))
+			break;
+
+	mutex_lock(&dc_devs_lock);
+	ret = dc_create(ch, dest, irq, size, i, cpu);
+	mutex_unlock(&dc_devs_lock);
+
+	return ret ? ret : count;
+}
+
+/* Remove a channel which is not in use: echo <ch> > delete_channel */
+static ssize_t dc_delete_channel_store(struct class *class,
+				       struct class_attribute *attr,
+				       const char *buf,
+				       size_t count)
+{
+	struct dc_dev_t *dev;
+	int ch, ret = 0;
+
+	if (kstrtoint(buf, 0, &ch))
+		return -EINVAL;
+
+	mutex_lock(&dc_devs_lock);
+
+	dev = dc_find(ch);
+	if (!dev)
+		ret = -ENODEV;
+	else if (dev->is_open || dev->groups)
+		ret = -EBUSY;
+	else
+		dc_destroy(dev);
+
+	mutex_unlock(&dc_devs_lock);
+
+	return ret ? ret : count;
+}
+
+/* Look up a multicast group, called with dc_devs_lock held */
+static struct dc_group_t *dc_group_find(int id)
+{
+	struct dc_group_t *grp;
+
+	list_for_each_entry(grp, &dc_groups_list, list)
+		if (grp->id == id)
+			return grp;
+
+	return NULL;
+}
+
+static int dc_group_open(struct inode *inode, struct file *filep)
+{
+	struct dc_group_t *grp;
+	int ret = 0;
+
+	mutex_lock(&dc_devs_lock);
+
+	grp = dc_group_find(iminor(inode) - DC_MAX_DEVS);
+	if (!grp) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	if (grp->is_open) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	grp->is_open = 1;
+	filep->private_data = grp;
+
+out:
+	mutex_unlock(&dc_devs_lock);
+
+	return ret;
+}
+
+static int dc_group_release(struct inode *inode, struct file *filep)
+{
+	struct dc_group_t *grp = filep->private_data;
+
+	mutex_lock(&dc_devs_lock);
+	grp->is_open = 0;
+	mutex_unlock(&dc_devs_lock);
+
+	return 0;
+}
+
+/*
+ * Send a whole write to one member, or nothing if Mango has no room for it,
+ * so every destination sees complete writes. Returns 1 if it was sent.
+ */
+static int dc_group_tx(struct dc_dev_t *dev, const unsigned char *p, int len)
+{
+	int ret = 0;
+
+	mutex_lock(&dev->tx_lock);
+
+	/* Coded channels frame the data themselves */
+	if (!dev->codec && mango_dc_tx_free_space(dev->ch) >= len)
+		ret = dc_hvc_write(dev, p, len) == len;
+
+	mutex_unlock(&dev->tx_lock);
+
+	return ret;
+}
+
+/*
+ * The data is copied from user space once and written to every member. A
+ * member without room drops the write and the others still get it, so a
+ * slow partition never stalls the group. Fails with -EAGAIN only if no
+ * member took the write.
+ */
+static ssize_t dc_group_write(struct file *filep,
+			      const char *buff,
+			      size_t len,
+			      loff_t *off)
+{
+	struct dc_group_t *grp = filep->private_data;
+	size_t size = (len > DC_BUFFER_SIZE) ? DC_BUFFER_SIZE : len;
+	struct dc_member_t *m;
+	int i, sent = 0;
+	ssize_t ret;
+
+	mutex_lock(&grp->lock);
+
+	for (i = 0; i < grp->nr_members; i++)
+		if (grp->members[i].dev->mode == MANGO_DC_MODE_MESSAGE &&
+		    len > MANGO_DC_MSG_MAX) {
+			ret = -EMSGSIZE;
+			goto out;
+		}
+
+	if (copy_from_user(grp->buf, buff, size)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < grp->nr_members; i++) {
+		m = &grp->members[i];
+
+		if (dc_group_tx(m->dev, grp->buf, size)) {
+			m->sent++;
+			sent++;
+		} else {
+			m->dropped++;
+			m->dropped_bytes += size;
+		}
+	}
+
+	ret = sent ? size : -EAGAIN;
+
+out:
+	mutex_unlock(&grp->lock);
+
+	return ret;
+}
+
+static struct file_operations dc_group_fops = {
+	.owner   = THIS_MODULE,
+	.write   = dc_group_write,
+	.open    = dc_group_open,
+	.release = dc_group_release
+};
+
+/* One line per member: channel, destination, writes sent, writes and bytes dropped */
+static ssize_t dc_members_show(struct device *d,
+			       struct device_attribute *attr,
+			       char *buf)
+{
+	struct dc_group_t *grp = dev_get_drvdata(d);
+	struct dc_member_t *m;
+	ssize_t len = 0;
+	int i;
+
+	mutex_lock(&grp->lock);
+
+	for (i = 0; i < grp->nr_members; i++) {
+		m = &grp->members[i];
+		len += sprintf(buf + len, "%d %d %lu %lu %lu\n",
+			       m->dev->ch, m->dev->dest, m->sent, m->dropped,
+			       m->dropped_bytes);
+	}
+
+	mutex_unlock(&grp->lock);
+
+	return len;
+}
+
+static DEVICE_ATTR(members, S_IRUGO, dc_members_show, NULL);
+
+static struct attribute *dc_group_attrs[] = {
+	&dev_attr_members.attr,
+	NULL
+};
+
+static const struct attribute_group dc_group_attr_group = {
+	.attrs = dc_group_attrs,
+};
+
+static const struct attribute_group *dc_group_attr_groups[] = {
+	&dc_group_attr_group,
+	NULL
+};
+
+/* Tear down a group, called with dc_devs_lock held */
+static void dc_group_destroy(struct dc_group_t *grp)
+{
+	struct dc_dev_t *dev;
+	int i;
+
+	device_destroy(class_dc, MKDEV(MAJOR(dc_devt), DC_MAX_DEVS + grp->id));
+	cdev_del(grp->cdev);
+
+	for (i = 0; i < grp->nr_members; i++) {
+		dev = grp->members[i].dev;
+		mutex_lock(&dev->tx_lock);
+		dev->groups--;
+		mutex_unlock(&dev->tx_lock);
+	}
+
+	list_del(&grp->list);
+	kfree(grp);
+}
+
+/* Set up a group of existing channels, called with dc_devs_lock held */
+static int dc_group_create(int id, const int *chs, int nr)
+{
+	struct dc_group_t *grp;
+	struct dc_dev_t *dev;
+	void *ptr_err;
+	int i, j, ret;
+
+	if (id < 0 || id >= DC_MAX_GROUPS || nr < 1 || nr > DC_GROUP_MAX_MEMBERS)
+		return -EINVAL;
+
+	if (dc_group_find(id))
+		return -EEXIST;
+
+	grp = kzalloc(sizeof(struct dc_group_t), GFP_KERNEL);
+	if (!grp)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		dev = dc_find(chs[i]);
+		if (!dev) {
+			ret = -ENODEV;
+			goto out_free;
+		}
+
+		if (dev->codec || dev->client) {
+			ret = -EBUSY;
+			goto out_free;
+		}
+
+		for (j = 0; j < i; j++)
+			if (grp->members[j].dev == dev) {
+				ret = -EINVAL;
+				goto out_free;
+			}
+
+		grp->members[i].dev = dev;
+	}
+
+	grp->id         = id;
+	grp->nr_members = nr;
+	mutex_init(&grp->lock);
+
+	grp->cdev = cdev_alloc();
+	if (!grp->cdev) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	grp->cdev->owner = THIS_MODULE;
+	grp->cdev->ops   = &dc_group_fops;
+
+	ret = cdev_add(grp->cdev, MKDEV(MAJOR(dc_devt), DC_MAX_DEVS + id), 1);
+	if (ret) {
+		printk(KERN_ALERT "mango_dc: register multicast group device failed with %d\n",
+		       ret);
+		kobject_put(&grp->cdev->kobj);
+		goto out_free;
+	}
+
+	grp->dev = device_create_with_groups(class_dc,
+					     NULL,
+					     MKDEV(MAJOR(dc_devt), DC_MAX_DEVS + id),
+					     grp,
+					     dc_group_attr_groups,
+					     GROUP_NAME "%d", id);
+	if (IS_ERR(ptr_err = grp->dev)) {
+		printk(KERN_ALERT "mango_dc: failed to create device dcg%d\n", id);
+		ret = PTR_ERR(ptr_err);
+		goto out_cdev;
+	}
+
+	/* The codec is set under tx_lock only */
+	for (i = 0; i < nr; i++) {
+		dev = grp->members[i].dev;
+		mutex_lock(&dev->tx_lock);
+		if (dev->codec)
+			ret = -EBUSY;
+		else
+			dev->groups++;
+		mutex_unlock(&dev->tx_lock);
+
+		if (ret) {
+			while (i--) {
+				dev = grp->members[i].dev;
+				mutex_lock(&dev->tx_lock);
+				dev->groups--;
+				mutex_unlock(&dev->tx_lock);
+			}
+			goto out_device;
+		}
+	}
+
+	list_add(&grp->list, &dc_groups_list);
+
+	return 0;
+
+out_device:
+	device_destroy(class_dc, MKDEV(MAJOR(dc_devt), DC_MAX_DEVS + id));
+out_cdev:
+	cdev_del(grp->cdev);
+out_free:
+	kfree(grp);
+
+	return ret;
+}
+
+/*
+ * Create a multicast group of channels, one per destination partition:
+ *   echo "<id> <ch> [<ch> ...]" > new_group
+ */
+static ssize_t dc_new_group_store(struct class *class,
+				  struct class_attribute *attr,
+				  const char *buf,
+				  size_t count)
+{
+	int ids[1 + DC_GROUP_MAX_MEMBERS];
+	int n = 0, pos, ret;
+
+	while (n < ARRAY_SIZE(ids) && sscanf(buf, "%d%n", &ids[n], &pos) == 1) {
+		buf += pos;
+		n++;
+	}
+
+	if (n < 2)
+		return -EINVAL;
+
+	mutex_lock(&dc_devs_lock);
+	ret = dc_group_create(ids[0], ids + 1, n - 1);
+	mutex_unlock(&dc_devs_lock);
+
+	return ret ? ret : count;
+}
+
+/* Remove a group which is not in use: echo <id> > delete_group */
+static ssize_t dc_delete_group_store(struct class *class,
+				     struct class_attribute *attr,
+				     const char *buf,
+				     size_t count)
+{
+	struct dc_group_t *grp;
+	int id, ret = 0;
+
+	if (kstrtoint(buf, 0, &id))
+		return -EINVAL;
+
+	mutex_lock(&dc_devs_lock);
+
+	grp = dc_group_find(id);
+	if (!grp)
+		ret = -ENODEV;
+	else if (grp->is_open)
+		ret = -EBUSY;
+	else
+		dc_group_destroy(grp);
+
+	mutex_unlock(&dc_devs_lock);
+
+	return ret ? ret : count;
+}
+
+static CLASS_ATTR(new_channel, S_IWUSR, NULL, dc_new_channel_store);
+static CLASS_ATTR(delete_channel, S_IWUSR, NULL, dc_delete_channel_store);
+static CLASS_ATTR(new_group, S_IWUSR, NULL, dc_new_group_store);
+static CLASS_ATTR(delete_group, S_IWUSR, NULL, dc_delete_group_store);
+
+void dc_module_exit(void)
+{
+	struct dc_group_t *grp, *gtmp;
+	struct dc_dev_t *dev, *tmp;
+
+	class_remove_file(class_dc, &class_attr_new_channel);
+	class_remove_file(class_dc, &class_attr_delete_channel);
+	class_remove_file(class_dc, &class_attr_new_group);
+	class_remove_file(class_dc, &class_attr_delete_group);
+
+	mutex_lock(&dc_devs_lock);
+	list_for_each_entry_safe(grp, gtmp, &dc_groups_list, list)
+		dc_group_destroy(grp);
+	list_for_each_entry_safe(dev, tmp, &dc_devs_list, list)
+		dc_destroy(dev);
+	mutex_unlock(&dc_devs_lock);
+
+	class_destroy(class_dc);
+	unregister_chrdev_region(dc_devt, DC_MAX_MINORS);
+}
+
+int dc_module_init(void)
+{
+	int i, ret;
+	void *ptr_err;
+
+	BUILD_BUG_ON(MANGO_DC_MSG_MAX + DC_MSG_HDR_SIZE > DC_BUFFER_SIZE);
+
+	ret = alloc_chrdev_region(&dc_devt, 0, DC_MAX_MINORS, DEVICE_NAME);
+	if (ret < 0) {
+		printk(KERN_ALERT "mango_dc: register data channel region failed with %d\n",
+		       ret);
+		return ret;
+	}
+
+	/* Create data channel device class */
+	class_dc = class_create(THIS_MODULE, CLASS_NAME);
+	if (IS_ERR(ptr_err = class_dc)) {
+		printk(KERN_ALERT "mango_dc: failed to create device class\n");
+		unregister_chrdev_region(dc_devt, DC_MAX_MINORS);
+		return -EINVAL;
+	}
+
+	if (class_create_file(class_dc, &class_attr_new_channel) ||
+	    class_create_file(class_dc, &class_attr_delete_channel) ||
+	    class_create_file(class_dc, &class_attr_new_group) ||
+	    class_create_file(class_dc, &class_attr_delete_group)) {
+		printk(KERN_ALERT "mango_dc: failed to create class attributes\n");
+		goto out;
+	}
+
+	mutex_lock(&dc_devs_lock);
+	for (i = 0; i < nr_devs; i++) {
+		ret = dc_create(i, dest_part, DC_IRQ_NR + i, DC_BUFFER_SIZE,
+				MANGO_DC_MODE_STREAM, -1);
+		if (ret)
+			break;
+	}
+	mutex_unlock(&dc_devs_lock);
+
+	if (ret)
+		goto out;
+
+	return 0;
+
 out:
 	dc_module_exit();
 
@@ -280,3 +2659,5 @@ MODULE_PARM_DESC(nr_devs, "number of data channel to create");
 MODULE_AUTHOR("Alexander Smirnov");
 MODULE_DESCRIPTION("Mango Data Channel");
 MODULE_LICENSE("GPL");
+/* Hypercalls are inline, mango_core must unlock Mango first */
+MODULE_SOFTDEP("pre: mango_core");
@@ -0,0 +1,152 @@
+/*
+ * Mango Data Channel tracepoints.
+ *
+ * Copyright (c) 2016 ilbers GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mango_dc
+
+#if !defined(_MANGO_DC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MANGO_DC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Hard IRQ of a channel, the message arrival time */
+TRACE_EVENT(mango_dc_irq,
+
+	TP_PROTO(int ch),
+
+	TP_ARGS(ch),
+
+	TP_STRUCT__entry(
+		__field(int, ch)
+	),
+
+	TP_fast_assign(
+		__entry->ch = ch;
+	),
+
+	TP_printk("ch=%d", __entry->ch)
+);
+
+/*
+ * One read from Mango in the IRQ thread. Lost is the number of stream bytes
+ * overwritten or, in message mode, of records dropped.
+ */
+TRACE_EVENT(mango_dc_rx,
+
+	TP_PROTO(int ch, int count, int fill, unsigned long lost),
+
+	TP_ARGS(ch, count, fill, lost),
+
+	TP_STRUCT__entry(
+		__field(int, ch)
+		__field(int, count)
+		__field(int, fill)
+		__field(unsigned long, lost)
+	),
+
+	TP_fast_assign(
+		__entry->ch    = ch;
+		__entry->count = count;
+		__entry->fill  = fill;
+		__entry->lost  = lost;
+	),
+
+	TP_printk("ch=%d count=%d fill=%d lost=%lu",
+		  __entry->ch, __entry->count, __entry->fill, __entry->lost)
+);
+
+/* Readers woken up after a drain round */
+TRACE_EVENT(mango_dc_wakeup,
+
+	TP_PROTO(int ch, int fill),
+
+	TP_ARGS(ch, fill),
+
+	TP_STRUCT__entry(
+		__field(int, ch)
+		__field(int, fill)
+	),
+
+	TP_fast_assign(
+		__entry->ch   = ch;
+		__entry->fill = fill;
+	),
+
+	TP_printk("ch=%d fill=%d", __entry->ch, __entry->fill)
+);
+
+/* IRQ thread done, the channel is drained */
+TRACE_EVENT(mango_dc_irq_exit,
+
+	TP_PROTO(int ch, int bytes),
+
+	TP_ARGS(ch, bytes),
+
+	TP_STRUCT__entry(
+		__field(int, ch)
+		__field(int, bytes)
+	),
+
+	TP_fast_assign(
+		__entry->ch    = ch;
+		__entry->bytes = bytes;
+	),
+
+	TP_printk("ch=%d bytes=%d", __entry->ch, __entry->bytes)
+);
+
+DECLARE_EVENT_CLASS(mango_dc_io,
+
+	TP_PROTO(int ch, size_t len, ssize_t ret),
+
+	TP_ARGS(ch, len, ret),
+
+	TP_STRUCT__entry(
+		__field(int, ch)
+		__field(size_t, len)
+		__field(ssize_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->ch  = ch;
+		__entry->len = len;
+		__entry->ret = ret;
+	),
+
+	TP_printk("ch=%d len=%zu ret=%zd", __entry->ch, __entry->len, __entry->ret)
+);
+
+DEFINE_EVENT(mango_dc_io, mango_dc_read,
+	TP_PROTO(int ch, size_t len, ssize_t ret),
+	TP_ARGS(ch, len, ret)
+);
+
+DEFINE_EVENT(mango_dc_io, mango_dc_write,
+	TP_PROTO(int ch, size_t len, ssize_t ret),
+	TP_ARGS(ch, len, ret)
+);
+
+#endif /* _MANGO_DC_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mango_dc_trace
+
+#include <trace/define_trace.h>
@@ -17,6 +17,26 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+/*
+ * Transmit side traffic classes
+ *
+ * The device has one TX queue per traffic class, set up by the mqprio
+ * qdisc with "hw 1". Packets are kept in per-class queues inside the
+ * driver and handed to Mango one at a time by mango_tx_run(), which picks
+ * the next class:
+ *
+ *  - classes with tc_quantum 0 are served by strict priority, the highest
+ *    class first,
+ *  - the others share the remaining bandwidth by deficit round robin with
+ *    tc_quantum bytes per round.
+ *
+ * So a control packet waits at most for the packet Mango is accepting,
+ * however much bulk traffic is queued. When Mango is full the queue is
+ * retried from a timer.
+ */
+
+#include <linux/ethtool.h>
+#include <linux/hrtimer.h>
 #include <linux/interrupt.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
@@ -25,9 +45,14 @@
 #include <linux/init.h>
 #include <linux/rtnetlink.h>
 #include <linux/moduleparam.h>
+#include <linux/workqueue.h>
 #include <net/rtnetlink.h>
 
 #include <mango.h>
+#include <mango_capture.h>
+
+#define CREATE_TRACE_POINTS
+#include "mango_net_trace.h"
 
 #define MANGO_NET_IRQ		140	/* IRQ number for networking */
 #define MANGO_NET_TARGET	1	/* Destination partition */
@@ -36,34 +61,243 @@
 #define NET_MODE_IRQ		1	/* Each incoming packet is signaled by IRQ */
 #define NET_MODE_POLL		2	/* No IRQ generated on incoming data */
 
+#define MANGO_NET_TXQ		4	/* TX queues, one per traffic class */
+#define MANGO_NET_TX_QLEN	64	/* Packets queued per class */
+#define MANGO_NET_TX_TIMEOUT	(HZ / 2) /* Stalled queue resets the interface */
+
 static int max_interrupt_work = 20;
 static unsigned int iface_count = 0;
 
+/* DRR quantum in bytes per class, 0 selects strict priority */
+static unsigned int tc_quantum[MANGO_NET_TXQ];
+static unsigned int tx_retry_us = 20;
+static bool reset_flush;
+
+/* Installed by mango_capture while it is loaded */
+static mango_capture_fn __rcu net_capture_hook;
+
+struct mango_tx_class {
+	struct sk_buff_head skbs;
+	int                 deficit;
+	bool                topped;		/* Quantum added this round */
+
+	u64                 packets;
+	u64                 bytes;
+	u64                 stopped;		/* Queue was full */
+	u64                 retries;		/* Mango was full */
+	u64                 lat_sum_ns;		/* Time spent in the queue */
+	u64                 lat_max_ns;
+};
+
+struct mango_tx_cb {
+	ktime_t stamp;
+};
+
+#define MANGO_TX_CB(skb)	((struct mango_tx_cb *)(skb)->cb)
+
 struct netdev_private {
 	struct napi_struct      napi;
 	struct net_device       *dev;
 	struct net_device_stats stats;
 	unsigned int            iface;
+
+	spinlock_t              tx_lock;	/* Protects tc and drr */
+	struct mango_tx_class   tc[MANGO_NET_TXQ];
+	unsigned int            drr;		/* Current DRR class */
+	struct tasklet_hrtimer  tx_timer;	/* Retries when Mango is full */
+
+	struct work_struct      reset_work;	/* Resets the Mango interface */
+	int                     dying;		/* Interface is torn down, no more resets */
+	u64                     resets;		/* Completed resets, under tx_lock */
+	u64                     reset_last_us;
+	u64                     reset_max_us;
+};
+
+static const char mango_dev_stats[][ETH_GSTRING_LEN] = {
+	"resets", "reset_last_us", "reset_max_us",
 };
 
+static const char mango_tc_stats[][ETH_GSTRING_LEN] = {
+	"packets", "bytes", "stopped", "retries", "lat_avg_ns", "lat_max_ns",
+};
+
+/* Next class to send from, -1 if all are empty */
+static int mango_tx_pick(struct netdev_private *np)
+{
+	struct mango_tx_class *c;
+	int i;
+
+	/* Strict priority classes first, the highest class wins */
+	for (i = MANGO_NET_TXQ - 1; i >= 0; i--)
+		if (!tc_quantum[i] && !skb_queue_empty(&np->tc[i].skbs))
+			return i;
+
+	for (i = 0; i < MANGO_NET_TXQ; i++)
+		if (tc_quantum[i] && !skb_queue_empty(&np->tc[i].skbs))
+			break;
+	if (i == MANGO_NET_TXQ)
+		return -1;
+
+	/* Deficit round robin, terminates as a backlogged deficit grows */
+	for (;;) {
+		c = &np->tc[np->drr];
+
+		if (tc_quantum[np->drr] && !skb_queue_empty(&c->skbs)) {
+			if (skb_peek(&c->skbs)->len <= c->deficit)
+				return np->drr;
+
+			if (!c->topped) {
+				c->deficit += tc_quantum[np->drr];
+				c->topped = true;
+				continue;
+			}
+		} else {
+			c->deficit = 0;
+		}
+
+		c->topped = false;
+		np->drr = (np->drr + 1) % MANGO_NET_TXQ;
+	}
+}
+
+/* Send queued packets until the queues are empty or Mango is full */
+static void mango_tx_run(struct netdev_private *np)
+{
+	struct net_device *dev = np->dev;
+	struct mango_tx_class *c;
+	struct sk_buff *skb;
+	unsigned int ret;
+	u64 lat;
+	int q;
+
+	while ((q = mango_tx_pick(np)) >= 0) {
+		c = &np->tc[q];
+		skb = skb_peek(&c->skbs);
+
+		/* Send packet to mango driver */
+		ret = mango_net_tx(np->iface, MANGO_NET_TARGET, skb->data, skb->len);
+		trace_mango_net_xmit(np->iface, skb->len, ret);
+		if (ret) {
+			c->retries++;
+			if (!hrtimer_is_queued(&np->tx_timer.timer))
+				tasklet_hrtimer_start(&np->tx_timer,
+						      ns_to_ktime(tx_retry_us * NSEC_PER_USEC),
+						      HRTIMER_MODE_REL);
+			break;
+		}
+
+		__skb_unlink(skb, &c->skbs);
+
+		if (tc_quantum[q])
+			c->deficit -= skb->len;
+
+		lat = ktime_to_ns(ktime_sub(ktime_get(), MANGO_TX_CB(skb)->stamp));
+		c->lat_sum_ns += lat;
+		if (lat > c->lat_max_ns)
+			c->lat_max_ns = lat;
+
+		c->packets++;
+		c->bytes += skb->len;
+
+		/* LLTX, the TX watchdog relies on the driver to update this */
+		netdev_get_tx_queue(dev, q)->trans_start = jiffies;
+
+		np->stats.tx_packets++;
+		np->stats.tx_bytes += skb->len;
+
+		dev_kfree_skb(skb);
+
+		if (__netif_subqueue_stopped(dev, q) &&
+		    skb_queue_len(&c->skbs) <= MANGO_NET_TX_QLEN / 2)
+			netif_wake_subqueue(dev, q);
+	}
+}
+
+static enum hrtimer_restart mango_tx_retry(struct hrtimer *timer)
+{
+	struct netdev_private *np = container_of(timer, struct netdev_private,
+						 tx_timer.timer);
+
+	spin_lock(&np->tx_lock);
+	mango_tx_run(np);
+	spin_unlock(&np->tx_lock);
+
+	return HRTIMER_NORESTART;
+}
+
 static netdev_tx_t mango_dev_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct netdev_private *np = netdev_priv(dev);
-	unsigned int ret;
+	u16 q = skb_get_queue_mapping(skb);
+	struct mango_tx_class *c = &np->tc[q];
 
-	/* Send packet to mango driver */
-	ret = mango_net_tx(np->iface, MANGO_NET_TARGET, skb->data, skb->len);
-	if (ret)
+	spin_lock(&np->tx_lock);
+
+	/* Several CPUs may pass the queue check, LLTX takes no queue lock */
+	if (skb_queue_len(&c->skbs) >= MANGO_NET_TX_QLEN) {
+		netif_stop_subqueue(dev, q);
+		c->stopped++;
+		spin_unlock(&np->tx_lock);
 		return NETDEV_TX_BUSY;
+	}
+
+	mango_capture(&net_capture_hook, MANGO_CAP_NET_TX, np->iface,
+		      skb->data, skb->len);
+
+	MANGO_TX_CB(skb)->stamp = ktime_get();
+	__skb_queue_tail(&c->skbs, skb);
+
+	if (skb_queue_len(&c->skbs) >= MANGO_NET_TX_QLEN) {
+		netdev_get_tx_queue(dev, q)->trans_start = jiffies;
+		netif_stop_subqueue(dev, q);
+		c->stopped++;
+	}
 
-	np->stats.tx_packets++;
-	np->stats.tx_bytes += skb->len;
+	mango_tx_run(np);
 
-	dev_kfree_skb(skb);
+	spin_unlock(&np->tx_lock);
 
 	return NETDEV_TX_OK;
 }
 
+static u16 mango_select_queue(struct net_device *dev, struct sk_buff *skb,
+			      void *accel_priv, select_queue_fallback_t fallback)
+{
+	/* Without traffic classes the device has a single FIFO */
+	if (!netdev_get_num_tc(dev))
+		return 0;
+
+	/* Maps skb->priority to the queue of its class */
+	return fallback(dev, skb);
+}
+
+/* Called by mqprio with "hw 1", one queue per class */
+static int mango_setup_tc(struct net_device *dev, u8 num_tc)
+{
+	int i;
+
+	if (num_tc > MANGO_NET_TXQ)
+		return -EINVAL;
+
+	if (!num_tc) {
+		netdev_reset_tc(dev);
+		return 0;
+	}
+
+	netdev_set_num_tc(dev, num_tc);
+	for (i = 0; i < num_tc; i++)
+		netdev_set_tc_queue(dev, i, 1, i);
+
+	return 0;
+}
+
+/* Reset the Mango interface, unless it is being torn down */
+static void mango_schedule_reset(struct netdev_private *np)
+{
+	if (!ACCESS_ONCE(np->dying))
+		schedule_work(&np->reset_work);
+}
+
 static int mango_dev_recv(struct net_device *dev, int *quota)
 {
 	struct netdev_private *np = netdev_priv(dev);
@@ -71,10 +305,13 @@ static int mango_dev_recv(struct net_device *dev, int *quota)
 	int ret = 1;
 	size_t size;
 
-	/* Get incoming data size */
+	/* Get incoming data size, Mango fails it once the peer was reset */
 	size = mango_net_get_rx_size(np->iface);
 
-	if (size == 0) {
+	if ((int)size < 0)
+		mango_schedule_reset(np);
+
+	if (size == 0 || (int)size < 0) {
 		ret = 0;
 		goto out;
 	}
@@ -88,6 +325,10 @@ static int mango_dev_recv(struct net_device *dev, int *quota)
 	np->stats.rx_packets++;
 	np->stats.rx_bytes += size;
 
+	trace_mango_net_rx(np->iface, size);
+	mango_capture(&net_capture_hook, MANGO_CAP_NET_RX, np->iface,
+		      skb->data, size);
+
 	skb->protocol = eth_type_trans(skb, dev);
 	netif_receive_skb(skb);
 
@@ -100,12 +341,17 @@ static int netdev_poll(struct napi_struct *napi, int budget)
 	struct netdev_private *np = container_of(napi, struct netdev_private, napi);
 	struct net_device *dev = np->dev;
 	int quota = budget;
+	int work = 0;
+
+	while (mango_dev_recv(dev, &quota))
+		work++;
 
-	while (mango_dev_recv(dev, &quota));
+	trace_mango_net_poll(np->iface, work, budget);
 
 	napi_complete(napi);
 
 	/* Restore IRQ signaling */
+	trace_mango_net_set_mode(np->iface, NET_MODE_IRQ);
 	mango_net_set_mode(np->iface, NET_MODE_IRQ);
 
 	return 0;
@@ -117,6 +363,7 @@ static irqreturn_t mango_dev_irq(int irq, void *data)
 	struct netdev_private *np = netdev_priv(dev);
 
 	/* Disable IRQ signaling for incomming data */
+	trace_mango_net_set_mode(np->iface, NET_MODE_POLL);
 	mango_net_set_mode(np->iface, NET_MODE_POLL);
 
 	if (likely(napi_schedule_prep(&np->napi)))
@@ -125,6 +372,76 @@ static irqreturn_t mango_dev_irq(int irq, void *data)
 	return IRQ_HANDLED;
 }
 
+/*
+ * Reset the Mango interface in place, e.g. after the peer partition
+ * restarted. The netdev stays registered and up. With reset_flush the
+ * packets queued for transmission are dropped, otherwise they are sent
+ * once the interface is back.
+ */
+static void mango_reset_work(struct work_struct *work)
+{
+	struct netdev_private *np = container_of(work, struct netdev_private,
+						 reset_work);
+	struct net_device *dev = np->dev;
+	ktime_t start = ktime_get();
+	int i, err = 0;
+	u64 us;
+
+	/* Scheduled while the interface was torn down */
+	if (ACCESS_ONCE(np->dying))
+		return;
+
+	netif_tx_disable(dev);
+	napi_disable(&np->napi);
+	disable_irq(MANGO_NET_IRQ);
+	tasklet_hrtimer_cancel(&np->tx_timer);
+
+	spin_lock_bh(&np->tx_lock);
+
+	if (mango_net_reset(np->iface)) {
+		mango_net_close(np->iface);
+		err = mango_net_open(np->iface);
+	}
+
+	if (!err)
+		mango_net_set_mode(np->iface, NET_MODE_IRQ);
+
+	if (reset_flush)
+		for (i = 0; i < MANGO_NET_TXQ; i++) {
+			np->stats.tx_dropped += skb_queue_len(&np->tc[i].skbs);
+			__skb_queue_purge(&np->tc[i].skbs);
+		}
+
+	if (!err) {
+		us = ktime_us_delta(ktime_get(), start);
+		np->resets++;
+		np->reset_last_us = us;
+		if (us > np->reset_max_us)
+			np->reset_max_us = us;
+	}
+
+	spin_unlock_bh(&np->tx_lock);
+
+	if (err)
+		printk(KERN_ALERT "mango_net: failed to reset mango interface\n");
+
+	enable_irq(MANGO_NET_IRQ);
+	napi_enable(&np->napi);
+	netif_tx_wake_all_queues(dev);
+
+	spin_lock_bh(&np->tx_lock);
+	mango_tx_run(np);
+	spin_unlock_bh(&np->tx_lock);
+}
+
+/* A TX queue was stopped for MANGO_NET_TX_TIMEOUT, the peer is gone */
+static void mango_tx_timeout(struct net_device *dev)
+{
+	struct netdev_private *np = netdev_priv(dev);
+
+	mango_schedule_reset(np);
+}
+
 static int mango_dev_init(struct net_device *dev)
 {
 	struct netdev_private *np = netdev_priv(dev);
@@ -147,7 +464,7 @@ static int mango_dev_init(struct net_device *dev)
 	enable_irq(MANGO_NET_IRQ);
 
 	napi_enable(&np->napi);
-	netif_start_queue(dev);
+	netif_tx_start_all_queues(dev);
 
 	err = mango_net_open(np->iface);
 	if (err) {
@@ -165,13 +482,29 @@ err:
 static void mango_dev_uninit(struct net_device *dev)
 {
 	struct netdev_private *np = netdev_priv(dev);
+	int i;
+
+	/* Running NAPI polls and timeouts may still ask for a reset */
+	ACCESS_ONCE(np->dying) = 1;
+	smp_mb();
+	cancel_work_sync(&np->reset_work);
 
-	netif_stop_queue(dev);
+	netif_tx_stop_all_queues(dev);
 	napi_disable(&np->napi);
 
+	tasklet_hrtimer_cancel(&np->tx_timer);
+
+	spin_lock_bh(&np->tx_lock);
+	for (i = 0; i < MANGO_NET_TXQ; i++)
+		__skb_queue_purge(&np->tc[i].skbs);
+	spin_unlock_bh(&np->tx_lock);
+
 	mango_net_close(np->iface);
 	disable_irq_nosync(MANGO_NET_IRQ);
 	free_irq(MANGO_NET_IRQ, (void *)dev);
+
+	/* Nothing may be left to run once the netdev is freed */
+	cancel_work_sync(&np->reset_work);
 }
 
 static struct net_device_stats *mango_get_stats(struct net_device *dev)
@@ -185,14 +518,99 @@ static struct net_device_stats *mango_get_stats(struct net_device *dev)
 
 	nstat->tx_packets = stat->tx_packets;
 	nstat->tx_bytes   = stat->tx_bytes;
+	nstat->tx_dropped = stat->tx_dropped;
 
 	return nstat;
 }
 
+static int mango_get_sset_count(struct net_device *dev, int sset)
+{
+	if (sset != ETH_SS_STATS)
+		return -EOPNOTSUPP;
+
+	return ARRAY_SIZE(mango_dev_stats) +
+	       MANGO_NET_TXQ * ARRAY_SIZE(mango_tc_stats);
+}
+
+static void mango_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	int i, j;
+
+	if (sset != ETH_SS_STATS)
+		return;
+
+	memcpy(data, mango_dev_stats, sizeof(mango_dev_stats));
+	data += sizeof(mango_dev_stats);
+
+	for (i = 0; i < MANGO_NET_TXQ; i++)
+		for (j = 0; j < ARRAY_SIZE(mango_tc_stats); j++) {
+			snprintf(data, ETH_GSTRING_LEN, "tc%d_%s", i,
+				 mango_tc_stats[j]);
+			data += ETH_GSTRING_LEN;
+		}
+}
+
+static void mango_get_ethtool_stats(struct net_device *dev,
+				    struct ethtool_stats *stats, u64 *data)
+{
+	struct netdev_private *np = netdev_priv(dev);
+	struct mango_tx_class *c;
+	u64 avg;
+	int i;
+
+	spin_lock_bh(&np->tx_lock);
+
+	*data++ = np->resets;
+	*data++ = np->reset_last_us;
+	*data++ = np->reset_max_us;
+
+	for (i = 0; i < MANGO_NET_TXQ; i++) {
+		c = &np->tc[i];
+
+		avg = c->lat_sum_ns;
+		if (c->packets)
+			do_div(avg, c->packets);
+
+		*data++ = c->packets;
+		*data++ = c->bytes;
+		*data++ = c->stopped;
+		*data++ = c->retries;
+		*data++ = avg;
+		*data++ = c->lat_max_ns;
+	}
+
+	spin_unlock_bh(&np->tx_lock);
+}
+
+/* ethtool --reset, any component resets the Mango interface */
+static int mango_ethtool_reset(struct net_device *dev, u32 *flags)
+{
+	struct netdev_private *np = netdev_priv(dev);
+
+	if (!*flags)
+		return -EINVAL;
+
+	mango_schedule_reset(np);
+	*flags = 0;
+
+	return 0;
+}
+
+static const struct ethtool_ops mango_ethtool_ops = {
+	.get_link		= ethtool_op_get_link,
+	.reset			= mango_ethtool_reset,
+	.get_sset_count		= mango_get_sset_count,
+	.get_strings		= mango_get_strings,
+	.get_ethtool_stats	= mango_get_ethtool_stats,
+};
+
 static const struct net_device_ops mango_netdev_ops = {
 	.ndo_init	= mango_dev_init,
 	.ndo_uninit	= mango_dev_uninit,
 	.ndo_start_xmit	= mango_dev_xmit,
+	.ndo_select_queue = mango_select_queue,
+	.ndo_setup_tc	= mango_setup_tc,
+	.ndo_tx_timeout	= mango_tx_timeout,
 	.ndo_get_stats  = mango_get_stats,
 };
 
@@ -202,10 +620,15 @@ static void mango_setup(struct net_device *dev)
 
 	/* Initialize the device structure. */
 	dev->netdev_ops = &mango_netdev_ops;
+	dev->ethtool_ops = &mango_ethtool_ops;
 	dev->destructor = free_netdev;
+	dev->watchdog_timeo = MANGO_NET_TX_TIMEOUT;
 
-	/* Fill in device structure with ethernet-generic values. */
-	dev->tx_queue_len = 0;
+	/*
+	 * Fill in device structure with ethernet-generic values. The per-class
+	 * qdiscs under mqprio drop everything with a zero queue length.
+	 */
+	dev->tx_queue_len = MANGO_NET_TX_QLEN;
 	dev->flags       &= ~IFF_MULTICAST;
 	dev->features	 |= NETIF_F_SG | NETIF_F_FRAGLIST | NETIF_F_TSO;
 	dev->features	 |= NETIF_F_HW_CSUM | NETIF_F_HIGHDMA | NETIF_F_LLTX;
@@ -214,6 +637,14 @@ static void mango_setup(struct net_device *dev)
 	eth_hw_addr_random(dev);
 }
 
+/* Install or remove (NULL) the capture hook, waits for running calls */
+void mango_net_set_capture(mango_capture_fn fn)
+{
+	rcu_assign_pointer(net_capture_hook, fn);
+	synchronize_sched();
+}
+EXPORT_SYMBOL(mango_net_set_capture);
+
 static struct rtnl_link_ops mango_link_ops __read_mostly = {
 	.kind	= "mango",
 	.setup	= mango_setup,
@@ -223,15 +654,23 @@ static int __init mango_init_one(void)
 {
 	struct net_device *dev_mango;
 	struct netdev_private *np;
-	int err;
+	int err, i;
 
-	dev_mango = alloc_netdev(sizeof(*np), "mango%d", mango_setup);
+	dev_mango = alloc_netdev_mq(sizeof(*np), "mango%d", mango_setup,
+				    MANGO_NET_TXQ);
 	if (!dev_mango)
 		return -ENOMEM;
 
 	np = netdev_priv(dev_mango);
 	np->dev = dev_mango;
 
+	spin_lock_init(&np->tx_lock);
+	for (i = 0; i < MANGO_NET_TXQ; i++)
+		__skb_queue_head_init(&np->tc[i].skbs);
+	tasklet_hrtimer_init(&np->tx_timer, mango_tx_retry,
+			     CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	INIT_WORK(&np->reset_work, mango_reset_work);
+
 	np->iface = iface_count++;
 
 	netif_napi_add(dev_mango, &np->napi, netdev_poll, max_interrupt_work);
@@ -274,6 +713,15 @@ static void __exit mango_cleanup_module(void)
 module_init(mango_init_module);
 module_exit(mango_cleanup_module);
 
+module_param_array(tc_quantum, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(tc_quantum, "DRR quantum in bytes per traffic class, 0 for strict priority");
+module_param(tx_retry_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(tx_retry_us, "delay before retrying when Mango is full");
+module_param(reset_flush, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(reset_flush, "drop queued packets when the interface is reset");
+
 MODULE_AUTHOR("Alexander Smirnov");
 MODULE_DESCRIPTION("Mango Cross-Partition Networking");
 MODULE_LICENSE("GPL");
+/* Hypercalls are inline, mango_core must unlock Mango first */
+MODULE_SOFTDEP("pre: mango_core");
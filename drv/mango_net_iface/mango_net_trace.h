@@ -0,0 +1,122 @@
+/*
+ * Mango networking tracepoints.
+ *
+ * Copyright (c) 2016 ilbers GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mango_net
+
+#if !defined(_MANGO_NET_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MANGO_NET_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Packet passed to Mango, ret is non-zero if Mango was busy */
+TRACE_EVENT(mango_net_xmit,
+
+	TP_PROTO(unsigned int iface, unsigned int len, unsigned int ret),
+
+	TP_ARGS(iface, len, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, iface)
+		__field(unsigned int, len)
+		__field(unsigned int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->iface = iface;
+		__entry->len   = len;
+		__entry->ret   = ret;
+	),
+
+	TP_printk("iface=%u len=%u %s", __entry->iface, __entry->len,
+		  __entry->ret ? "busy" : "ok")
+);
+
+/* Packet received from Mango */
+TRACE_EVENT(mango_net_rx,
+
+	TP_PROTO(unsigned int iface, unsigned int len),
+
+	TP_ARGS(iface, len),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, iface)
+		__field(unsigned int, len)
+	),
+
+	TP_fast_assign(
+		__entry->iface = iface;
+		__entry->len   = len;
+	),
+
+	TP_printk("iface=%u len=%u", __entry->iface, __entry->len)
+);
+
+/* NAPI poll round */
+TRACE_EVENT(mango_net_poll,
+
+	TP_PROTO(unsigned int iface, int work, int budget),
+
+	TP_ARGS(iface, work, budget),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, iface)
+		__field(int, work)
+		__field(int, budget)
+	),
+
+	TP_fast_assign(
+		__entry->iface  = iface;
+		__entry->work   = work;
+		__entry->budget = budget;
+	),
+
+	TP_printk("iface=%u work=%d budget=%d",
+		  __entry->iface, __entry->work, __entry->budget)
+);
+
+/* Switch between IRQ and polling mode */
+TRACE_EVENT(mango_net_set_mode,
+
+	TP_PROTO(unsigned int iface, unsigned int mode),
+
+	TP_ARGS(iface, mode),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, iface)
+		__field(unsigned int, mode)
+	),
+
+	TP_fast_assign(
+		__entry->iface = iface;
+		__entry->mode  = mode;
+	),
+
+	TP_printk("iface=%u mode=%s", __entry->iface,
+		  __print_symbolic(__entry->mode, { 1, "irq" }, { 2, "poll" }))
+);
+
+#endif /* _MANGO_NET_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mango_net_trace
+
+#include <trace/define_trace.h>
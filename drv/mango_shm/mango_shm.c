@@ -0,0 +1,380 @@
+/*
+ * Linux driver for Mango cross-partition shared memory.
+ *
+ * Copyright (c) 2016 ilbers GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Mango maps one physical memory region into two partitions. The region is
+ * handed to user space with mmap(), so bulk data never passes through
+ * hypercalls. Each side signals the other with a notify hypercall, which
+ * raises the doorbell IRQ of the peer.
+ *
+ * Built with MANGO_SHM_SOFT=y the driver does not touch Mango at all: the
+ * region is ordinary vmalloc memory and a notify rings the local doorbell.
+ * Two processes on one plain Linux machine can then exercise the protocol
+ * they would run across partitions.
+ */
+
+#include <linux/eventfd.h>
+#include <linux/fs.h>
+#include <linux/interrupt.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <asm/uaccess.h>
+
+#ifndef MANGO_SHM_SOFT
+#include <mango.h>
+#endif
+#include <mango_shm.h>
+
+#define CLASS_NAME		"mango_shm"	/* Device class name */
+#define DEVICE_NAME		"mango_shm"	/* /dev/mango_shm, /dev/shm is the POSIX tmpfs */
+#define SHM_IRQ_NR		150		/* Default doorbell IRQ */
+#define SHM_SOFT_SIZE		(1024 * 1024)	/* Default software region size */
+
+struct shm_dev_t {
+	int               major;
+	struct class      *class_shm;
+	struct device     *dev;
+	void              *vbuf;		/* Software backend region */
+	u64               doorbells;		/* Doorbells rung by the peer */
+	spinlock_t        lock;			/* Protects doorbells and files */
+	struct list_head  files;		/* Open files */
+	wait_queue_head_t wq;			/* Readers waiting for a doorbell */
+};
+
+/* Per open file state */
+struct shm_file_t {
+	struct list_head   list;
+	struct shm_dev_t   *dev;
+	u64                seen;		/* Doorbells already read */
+	struct eventfd_ctx *efd;		/* Signaled on every doorbell */
+};
+
+static struct shm_dev_t shm_dev;
+
+static unsigned long base;
+static unsigned long size;
+static int irq = SHM_IRQ_NR;
+static unsigned int region;
+
+static void shm_doorbell(struct shm_dev_t *dev)
+{
+	struct shm_file_t *f;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->lock, flags);
+
+	dev->doorbells++;
+
+	list_for_each_entry(f, &dev->files, list)
+		if (f->efd)
+			eventfd_signal(f->efd, 1);
+
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	wake_up_interruptible(&dev->wq);
+}
+
+#ifndef MANGO_SHM_SOFT
+static irqreturn_t shm_irq(int irq, void *data)
+{
+	shm_doorbell(data);
+
+	return IRQ_HANDLED;
+}
+#endif
+
+static int shm_notify(struct shm_dev_t *dev)
+{
+#ifdef MANGO_SHM_SOFT
+	shm_doorbell(dev);
+
+	return 0;
+#else
+	return mango_shm_notify(region) ? -EIO : 0;
+#endif
+}
+
+static int shm_pending(struct shm_file_t *f)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&f->dev->lock, flags);
+	ret = f->dev->doorbells != f->seen;
+	spin_unlock_irqrestore(&f->dev->lock, flags);
+
+	return ret;
+}
+
+static int shm_open(struct inode *inode, struct file *filep)
+{
+	struct shm_dev_t *dev = &shm_dev;
+	struct shm_file_t *f;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+
+	f->dev = dev;
+
+	/* Only doorbells rung after open are reported */
+	spin_lock_irq(&dev->lock);
+	f->seen = dev->doorbells;
+	list_add(&f->list, &dev->files);
+	spin_unlock_irq(&dev->lock);
+
+	filep->private_data = f;
+
+	return 0;
+}
+
+static int shm_release(struct inode *inode, struct file *filep)
+{
+	struct shm_file_t *f = filep->private_data;
+
+	spin_lock_irq(&f->dev->lock);
+	list_del(&f->list);
+	spin_unlock_irq(&f->dev->lock);
+
+	if (f->efd)
+		eventfd_ctx_put(f->efd);
+
+	kfree(f);
+
+	return 0;
+}
+
+static ssize_t shm_read(struct file *filep,
+			char __user *buffer,
+			size_t length,
+			loff_t *offset)
+{
+	struct shm_file_t *f = filep->private_data;
+	struct shm_dev_t *dev = f->dev;
+	u64 count;
+
+	if (length < sizeof(count))
+		return -EINVAL;
+
+	if (!shm_pending(f)) {
+		if (filep->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(dev->wq, shm_pending(f)))
+			return -ERESTARTSYS;
+	}
+
+	spin_lock_irq(&dev->lock);
+	count = dev->doorbells - f->seen;
+	f->seen = dev->doorbells;
+	spin_unlock_irq(&dev->lock);
+
+	if (copy_to_user(buffer, &count, sizeof(count)))
+		return -EFAULT;
+
+	return sizeof(count);
+}
+
+static unsigned int shm_poll(struct file *filep, poll_table *wait)
+{
+	struct shm_file_t *f = filep->private_data;
+
+	poll_wait(filep, &f->dev->wq, wait);
+
+	return shm_pending(f) ? POLLIN | POLLRDNORM : 0;
+}
+
+static int shm_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+#ifdef MANGO_SHM_SOFT
+	return remap_vmalloc_range(vma, shm_dev.vbuf, vma->vm_pgoff);
+#else
+	/* Checks the offset and the length against the region */
+	return vm_iomap_memory(vma, base, size);
+#endif
+}
+
+static int shm_set_eventfd(struct shm_file_t *f, int fd)
+{
+	struct eventfd_ctx *efd = NULL, *old;
+
+	if (fd >= 0) {
+		efd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(efd))
+			return PTR_ERR(efd);
+	}
+
+	spin_lock_irq(&f->dev->lock);
+	old = f->efd;
+	f->efd = efd;
+	spin_unlock_irq(&f->dev->lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+static long shm_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	struct shm_file_t *f = filep->private_data;
+	struct mango_shm_info info;
+
+	switch (cmd) {
+	case MANGO_SHM_GET_INFO:
+		memset(&info, 0, sizeof(info));
+		info.size   = size;
+		info.region = region;
+#ifdef MANGO_SHM_SOFT
+		info.flags  = MANGO_SHM_F_SOFT;
+#endif
+		if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+			return -EFAULT;
+		return 0;
+	case MANGO_SHM_NOTIFY:
+		return shm_notify(f->dev);
+	case MANGO_SHM_SET_EVENTFD:
+		return shm_set_eventfd(f, (int)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static struct file_operations shm_fops = {
+	.owner          = THIS_MODULE,
+	.read           = shm_read,
+	.poll           = shm_poll,
+	.mmap           = shm_mmap,
+	.unlocked_ioctl = shm_ioctl,
+	.open           = shm_open,
+	.release        = shm_release
+};
+
+void shm_module_exit(void)
+{
+	struct shm_dev_t *dev = &shm_dev;
+
+	device_destroy(dev->class_shm, MKDEV(dev->major, 0));
+	class_destroy(dev->class_shm);
+	unregister_chrdev(dev->major, DEVICE_NAME);
+
+#ifdef MANGO_SHM_SOFT
+	vfree(dev->vbuf);
+#else
+	free_irq(irq, dev);
+#endif
+}
+
+int shm_module_init(void)
+{
+	struct shm_dev_t *dev = &shm_dev;
+	void *ptr_err;
+	int err;
+
+	spin_lock_init(&dev->lock);
+	INIT_LIST_HEAD(&dev->files);
+	init_waitqueue_head(&dev->wq);
+
+#ifdef MANGO_SHM_SOFT
+	if (!size)
+		size = SHM_SOFT_SIZE;
+	size = PAGE_ALIGN(size);
+
+	dev->vbuf = vmalloc_user(size);
+	if (!dev->vbuf)
+		return -ENOMEM;
+#else
+	if (!base || !size || !PAGE_ALIGNED(base) || !PAGE_ALIGNED(size)) {
+		printk(KERN_ALERT "mango_shm: base and size must be set and page aligned\n");
+		return -EINVAL;
+	}
+
+	err = request_irq(irq, shm_irq, 0, "mango_shm", dev);
+	if (err) {
+		printk(KERN_ALERT "mango_shm: failed to request doorbell IRQ %d\n", irq);
+		return err;
+	}
+#endif
+
+	dev->major = register_chrdev(0, DEVICE_NAME, &shm_fops);
+	if (dev->major < 0) {
+		printk(KERN_ALERT "mango_shm: register device failed with %d\n", dev->major);
+		err = dev->major;
+		goto err;
+	}
+
+	dev->class_shm = class_create(THIS_MODULE, CLASS_NAME);
+	if (IS_ERR(ptr_err = dev->class_shm)) {
+		printk(KERN_ALERT "mango_shm: failed to create device class\n");
+		err = PTR_ERR(ptr_err);
+		goto err_unreg;
+	}
+
+	dev->dev = device_create(dev->class_shm,
+				 NULL,
+				 MKDEV(dev->major, 0),
+				 NULL,
+				 DEVICE_NAME);
+	if (IS_ERR(ptr_err = dev->dev)) {
+		printk(KERN_ALERT "mango_shm: failed to create device\n");
+		err = PTR_ERR(ptr_err);
+		goto err_destroy;
+	}
+
+	return 0;
+
+err_destroy:
+	class_destroy(dev->class_shm);
+err_unreg:
+	unregister_chrdev(dev->major, DEVICE_NAME);
+err:
+#ifdef MANGO_SHM_SOFT
+	vfree(dev->vbuf);
+#else
+	free_irq(irq, dev);
+#endif
+	return err;
+}
+
+module_init(shm_module_init);
+module_exit(shm_module_exit);
+
+module_param(base, ulong, S_IRUGO);
+MODULE_PARM_DESC(base, "physical address of the shared region");
+module_param(size, ulong, S_IRUGO);
+MODULE_PARM_DESC(size, "size of the shared region in bytes");
+module_param(irq, int, S_IRUGO);
+MODULE_PARM_DESC(irq, "doorbell IRQ raised by the peer");
+module_param(region, uint, S_IRUGO);
+MODULE_PARM_DESC(region, "Mango region identifier passed to notify");
+
+MODULE_AUTHOR("Alexander Smirnov");
+MODULE_DESCRIPTION("Mango Shared Memory");
+MODULE_LICENSE("GPL");
+#ifndef MANGO_SHM_SOFT
+/* Hypercalls are inline, mango_core must unlock Mango first */
+MODULE_SOFTDEP("pre: mango_core");
+#endif
@@ -0,0 +1,425 @@
+/*
+ * Mango partition run time and steal time accounting.
+ *
+ * Copyright (c) 2016 ilbers GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Mango reports the CPU time given to the partition as a 32-bit counter.
+ * It is extended to 64 bits here and sampled periodically, so it never
+ * wraps unnoticed. Steal time is the wall time elapsed since the module
+ * was loaded minus the run time Mango granted meanwhile.
+ *
+ * Both values are exported:
+ *   - to the scheduler as paravirt steal time, so top and /proc/stat show
+ *     it as "st". ARM kernels have the steal clock hook from 4.3 on, with
+ *     CONFIG_PARAVIRT_TIME_ACCOUNTING,
+ *   - as the "mango" perf PMU with run_time and steal counting events,
+ *   - in /sys/kernel/mango_time.
+ *
+ * Mango accounts run time per partition, not per CPU, so it is reported as
+ * steal time of the boot CPU only. The other CPUs show no steal time. For
+ * the same reason the PMU counts on CPU 0 only, like uncore PMUs do, so
+ * "perf stat -a" does not add up the same value for every CPU.
+ */
+
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/kobject.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/perf_event.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+/* The ARM paravirt steal clock appeared in 4.3 */
+#if defined(CONFIG_PARAVIRT_TIME_ACCOUNTING) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+#define MT_PV_STEAL
+#include <linux/static_key.h>
+#include <asm/paravirt.h>
+#endif
+
+#include <mango.h>
+
+#define MT_WRAP_CHECK_MAX_MS	60000	/* Longest interval between samples */
+
+/* perf event config values */
+#define MT_EVENT_RUN_TIME	0
+#define MT_EVENT_STEAL		1
+#define MT_EVENT_MAX		2
+
+struct mt_state {
+	spinlock_t       lock;		/* Protects everything below */
+	u32              last_raw;	/* Last value read from Mango */
+	u64              run_units;	/* Run time in Mango units, 64-bit */
+	s64              base_wall;	/* Wall time at load, ns */
+	u64              base_run;	/* Run time at load, ns */
+	ktime_t          last_sample;
+	u64              run_ns;	/* Cached run time since load */
+	u64              steal_ns;	/* Cached steal time since load */
+	struct delayed_work wrap_work;
+	unsigned long    wrap_period;	/* jiffies */
+};
+
+static struct mt_state mt;
+
+static unsigned int run_time_unit_ns = 1000;
+static unsigned int sample_us = 100;
+
+/* Read Mango and update the cached values, called with mt.lock held */
+static void mt_sample_locked(ktime_t now)
+{
+	u32 raw = mango_get_partition_run_time();
+	s64 wall;
+	u64 run;
+
+	mt.run_units += (u32)(raw - mt.last_raw);
+	mt.last_raw = raw;
+	mt.last_sample = now;
+
+	run = mt.run_units * run_time_unit_ns - mt.base_run;
+	wall = ktime_to_ns(now) - mt.base_wall;
+
+	mt.run_ns = run;
+
+	/* Steal time must never go backwards */
+	if (wall > 0 && (u64)wall > run && (u64)wall - run > mt.steal_ns)
+		mt.steal_ns = (u64)wall - run;
+}
+
+/*
+ * Return the run time and steal time since load. Mango is asked at most
+ * once per sample_us, callers in between get the cached values.
+ */
+static void mt_read(u64 *run_ns, u64 *steal_ns)
+{
+	ktime_t now = ktime_get();
+	unsigned long flags;
+
+	spin_lock_irqsave(&mt.lock, flags);
+
+	if (ktime_us_delta(now, mt.last_sample) >= sample_us)
+		mt_sample_locked(now);
+
+	if (run_ns)
+		*run_ns = mt.run_ns;
+	if (steal_ns)
+		*steal_ns = mt.steal_ns;
+
+	spin_unlock_irqrestore(&mt.lock, flags);
+}
+
+static void mt_wrap_work(struct work_struct *work)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&mt.lock, flags);
+	mt_sample_locked(ktime_get());
+	spin_unlock_irqrestore(&mt.lock, flags);
+
+	schedule_delayed_work(&mt.wrap_work, mt.wrap_period);
+}
+
+#ifdef MT_PV_STEAL
+static u64 mt_steal_clock(int cpu)
+{
+	u64 steal;
+
+	if (cpu)
+		return 0;
+
+	mt_read(NULL, &steal);
+
+	return steal;
+}
+
+/*
+ * The scheduler keeps the last steal time it saw per run queue and expects
+ * the clock to only grow. A reloaded module would start again at 0 and the
+ * difference would wrap, so once installed the module stays loaded. This
+ * also keeps mt_steal_clock() alive for CPUs which are still calling it.
+ */
+static void mt_steal_init(void)
+{
+	__module_get(THIS_MODULE);
+
+	pv_time_ops.steal_clock = mt_steal_clock;
+
+	static_key_slow_inc(&paravirt_steal_enabled);
+	static_key_slow_inc(&paravirt_steal_rq_enabled);
+}
+#else
+static void mt_steal_init(void)
+{
+	printk(KERN_ALERT "mango_time: no paravirt time accounting, steal time in sysfs and perf only\n");
+}
+#endif
+
+/***********************************/
+/*            perf PMU             */
+/***********************************/
+static u64 mt_event_value(struct perf_event *event)
+{
+	u64 run, steal;
+
+	mt_read(&run, &steal);
+
+	return (event->attr.config == MT_EVENT_RUN_TIME) ? run : steal;
+}
+
+static void mt_event_update(struct perf_event *event)
+{
+	u64 now = mt_event_value(event);
+	u64 prev = local64_xchg(&event->hw.prev_count, now);
+
+	local64_add(now - prev, &event->count);
+}
+
+static int mt_event_init(struct perf_event *event)
+{
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+
+	/* Counting only, the values do not belong to any task */
+	if (is_sampling_event(event) || event->attach_state & PERF_ATTACH_TASK)
+		return -EINVAL;
+
+	/* The counters are partition wide, see mt_pmu_cpumask_show() */
+	if (event->cpu != 0 || event->attr.config >= MT_EVENT_MAX)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void mt_event_start(struct perf_event *event, int flags)
+{
+	local64_set(&event->hw.prev_count, mt_event_value(event));
+	event->hw.state = 0;
+}
+
+static void mt_event_stop(struct perf_event *event, int flags)
+{
+	if (event->hw.state & PERF_HES_STOPPED)
+		return;
+
+	mt_event_update(event);
+	event->hw.state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
+
+static int mt_event_add(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+
+	if (flags & PERF_EF_START)
+		mt_event_start(event, flags);
+
+	return 0;
+}
+
+static void mt_event_del(struct perf_event *event, int flags)
+{
+	mt_event_stop(event, PERF_EF_UPDATE);
+}
+
+static void mt_event_read(struct perf_event *event)
+{
+	mt_event_update(event);
+}
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+static struct attribute *mt_format_attrs[] = {
+	&format_attr_event.attr,
+	NULL,
+};
+
+static struct attribute_group mt_format_group = {
+	.name  = "format",
+	.attrs = mt_format_attrs,
+};
+
+PMU_EVENT_ATTR_STRING(run_time, mt_attr_run_time, "event=0x00");
+PMU_EVENT_ATTR_STRING(run_time.unit, mt_attr_run_time_unit, "ns");
+PMU_EVENT_ATTR_STRING(steal, mt_attr_steal, "event=0x01");
+PMU_EVENT_ATTR_STRING(steal.unit, mt_attr_steal_unit, "ns");
+
+static struct attribute *mt_event_attrs[] = {
+	&mt_attr_run_time.attr.attr,
+	&mt_attr_run_time_unit.attr.attr,
+	&mt_attr_steal.attr.attr,
+	&mt_attr_steal_unit.attr.attr,
+	NULL,
+};
+
+static struct attribute_group mt_event_group = {
+	.name  = "events",
+	.attrs = mt_event_attrs,
+};
+
+/* Tells perf to open system wide events on CPU 0 only */
+static ssize_t mt_pmu_cpumask_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "0\n");
+}
+
+static DEVICE_ATTR(cpumask, S_IRUGO, mt_pmu_cpumask_show, NULL);
+
+static struct attribute *mt_pmu_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL,
+};
+
+static struct attribute_group mt_pmu_attr_group = {
+	.attrs = mt_pmu_attrs,
+};
+
+static const struct attribute_group *mt_pmu_groups[] = {
+	&mt_pmu_attr_group,
+	&mt_format_group,
+	&mt_event_group,
+	NULL,
+};
+
+static struct pmu mt_pmu = {
+	.task_ctx_nr  = perf_invalid_context,
+	.attr_groups  = mt_pmu_groups,
+	.event_init   = mt_event_init,
+	.add          = mt_event_add,
+	.del          = mt_event_del,
+	.start        = mt_event_start,
+	.stop         = mt_event_stop,
+	.read         = mt_event_read,
+};
+
+/***********************************/
+/*             sysfs               */
+/***********************************/
+static ssize_t run_time_ns_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	u64 run;
+
+	mt_read(&run, NULL);
+
+	return sprintf(buf, "%llu\n", run);
+}
+
+static ssize_t steal_ns_show(struct kobject *kobj,
+			     struct kobj_attribute *attr, char *buf)
+{
+	u64 steal;
+
+	mt_read(NULL, &steal);
+
+	return sprintf(buf, "%llu\n", steal);
+}
+
+static struct kobj_attribute mt_run_time_attr = __ATTR_RO(run_time_ns);
+static struct kobj_attribute mt_steal_attr = __ATTR_RO(steal_ns);
+
+static struct attribute *mt_attrs[] = {
+	&mt_run_time_attr.attr,
+	&mt_steal_attr.attr,
+	NULL,
+};
+
+static struct attribute_group mt_attr_group = {
+	.attrs = mt_attrs,
+};
+
+static struct kobject *mt_kobj;
+
+/* Only reached without paravirt steal time, see mt_steal_init() */
+static void __exit mt_module_exit(void)
+{
+	perf_pmu_unregister(&mt_pmu);
+	sysfs_remove_group(mt_kobj, &mt_attr_group);
+	kobject_put(mt_kobj);
+	cancel_delayed_work_sync(&mt.wrap_work);
+}
+
+static int __init mt_module_init(void)
+{
+	u64 wrap_ms;
+	int ret;
+
+	if (!run_time_unit_ns) {
+		printk(KERN_ALERT "mango_time: run_time_unit_ns must not be 0\n");
+		return -EINVAL;
+	}
+
+	spin_lock_init(&mt.lock);
+	INIT_DELAYED_WORK(&mt.wrap_work, mt_wrap_work);
+
+	mt.last_raw = mango_get_partition_run_time();
+	mt.run_units = mt.last_raw;
+	mt.base_run = mt.run_units * run_time_unit_ns;
+	mt.last_sample = ktime_get();
+	mt.base_wall = ktime_to_ns(mt.last_sample);
+
+	/* Sample at least four times per 32-bit wrap of the Mango counter */
+	wrap_ms = div_u64((1ULL << 32) * run_time_unit_ns, 4 * NSEC_PER_MSEC);
+	wrap_ms = clamp_t(u64, wrap_ms, 1, MT_WRAP_CHECK_MAX_MS);
+	mt.wrap_period = msecs_to_jiffies(wrap_ms);
+	schedule_delayed_work(&mt.wrap_work, mt.wrap_period);
+
+	mt_kobj = kobject_create_and_add("mango_time", kernel_kobj);
+	if (!mt_kobj) {
+		ret = -ENOMEM;
+		goto err_work;
+	}
+
+	ret = sysfs_create_group(mt_kobj, &mt_attr_group);
+	if (ret)
+		goto err_kobj;
+
+	ret = perf_pmu_register(&mt_pmu, "mango", -1);
+	if (ret) {
+		printk(KERN_ALERT "mango_time: register PMU failed with %d\n", ret);
+		goto err_group;
+	}
+
+	mt_steal_init();
+
+	return 0;
+
+err_group:
+	sysfs_remove_group(mt_kobj, &mt_attr_group);
+err_kobj:
+	kobject_put(mt_kobj);
+err_work:
+	cancel_delayed_work_sync(&mt.wrap_work);
+	return ret;
+}
+
+module_init(mt_module_init);
+module_exit(mt_module_exit);
+
+module_param(run_time_unit_ns, uint, S_IRUGO);
+MODULE_PARM_DESC(run_time_unit_ns, "unit of the Mango partition run time counter in ns");
+module_param(sample_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sample_us, "minimal interval between run time hypercalls");
+
+MODULE_AUTHOR("Alexander Smirnov");
+MODULE_DESCRIPTION("Mango Partition Time Accounting");
+MODULE_LICENSE("GPL");
+/* Hypercalls are inline, mango_core must unlock Mango first */
+MODULE_SOFTDEP("pre: mango_core");
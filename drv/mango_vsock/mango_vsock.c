@@ -0,0 +1,855 @@
+/*
+ * AF_VSOCK transport over Mango data channels.
+ *
+ * Copyright (c) 2016 ilbers GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Every peer partition is reached through one dedicated data channel in
+ * stream mode. The channels are created by mango_data_channel, bound to
+ * the peer partition, and attached here as in-kernel clients, so user space
+ * cannot open them while the transport is loaded.
+ *
+ * Packets carry a fixed header followed by the payload, so any number of
+ * connections share a channel. Flow control is credit based: each header
+ * advertises the receive buffer size and the number of bytes the
+ * application has consumed, and a sender never has more bytes in flight
+ * than the peer can buffer.
+ *
+ * The address of a partition is MANGO_VSOCK_CID_BASE plus its Mango
+ * partition ID.
+ */
+
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <net/af_vsock.h>
+#include <net/sock.h>
+
+#include <mango.h>
+#include <mango_dc.h>
+
+#define MANGO_VSOCK_CID_BASE	3	/* CID of partition 0, above VMADDR_CID_HOST */
+#define MANGO_VSOCK_MAX_PEERS	16
+#define MANGO_VSOCK_MAX_PKT	4096	/* Largest payload of one packet */
+
+#define MANGO_VSOCK_BUF_SIZE	(256 * 1024)	/* Default receive buffer */
+#define MANGO_VSOCK_BUF_MIN	4096
+#define MANGO_VSOCK_BUF_MAX	(1024 * 1024)
+
+/* Packet types */
+#define MANGO_VSOCK_OP_REQUEST	1	/* Connection request */
+#define MANGO_VSOCK_OP_RESPONSE	2	/* Connection accepted */
+#define MANGO_VSOCK_OP_RST	3	/* Connection refused or aborted */
+#define MANGO_VSOCK_OP_SHUTDOWN	4	/* Half close, flags are RCV/SEND_SHUTDOWN */
+#define MANGO_VSOCK_OP_RW	5	/* Payload */
+#define MANGO_VSOCK_OP_CREDIT	6	/* Credit update */
+
+struct mango_vsock_hdr {
+	__le32 src_port;
+	__le32 dst_port;
+	__le32 len;			/* Payload length */
+	__le16 op;			/* MANGO_VSOCK_OP_* */
+	__le16 flags;
+	__le32 buf_alloc;		/* Receive buffer size of the sender */
+	__le32 fwd_cnt;			/* Bytes consumed by the sender */
+} __packed;
+
+/* Packet as queued for transmission or reception */
+struct mvs_pkt {
+	struct list_head       list;
+	struct mango_dc_txbuf  tx;	/* Transmit request */
+	u32                    off;	/* Bytes received or consumed */
+	u32                    len;	/* Payload length */
+	struct mango_vsock_hdr hdr;	/* Header and payload are contiguous */
+	unsigned char          data[];
+};
+
+/* Link to one peer partition */
+struct mvs_link {
+	int                    ch;		/* Mango data channel identifier */
+	int                    dest;		/* Peer partition */
+	struct mango_dc_client *client;	/* Attached data channel */
+	struct mango_vsock_hdr rx_hdr;		/* Header being received */
+	unsigned int           rx_hdr_len;
+	struct mvs_pkt         *rx_pkt;	/* Packet being received */
+	u32                    rx_skip;	/* Payload bytes to drop */
+	int                    ready;		/* client and dest are set */
+};
+
+/* Per socket transport state, protected by the socket lock */
+struct mvs_trans {
+	struct list_head rx_queue;		/* Received packets */
+	u32              rx_bytes;		/* Bytes in rx_queue */
+	u32              buf_alloc;		/* Receive buffer size */
+	u32              buf_min;
+	u32              buf_max;
+	u32              fwd_cnt;		/* Bytes consumed by the application */
+	u32              last_fwd_cnt;		/* fwd_cnt last sent to the peer */
+	u32              tx_cnt;		/* Bytes sent */
+	u32              peer_buf_alloc;
+	u32              peer_fwd_cnt;
+};
+
+#define mvs_trans(vsk)	((struct mvs_trans *)(vsk)->trans)
+
+static int channels[MANGO_VSOCK_MAX_PEERS];
+static int nr_channels;
+
+static struct mvs_link mvs_links[MANGO_VSOCK_MAX_PEERS];
+static u32 mvs_local_cid;
+
+static struct mvs_link *mvs_link_by_cid(u32 cid)
+{
+	int i;
+
+	for (i = 0; i < nr_channels; i++)
+		if (mvs_links[i].dest + MANGO_VSOCK_CID_BASE == cid)
+			return &mvs_links[i];
+
+	return NULL;
+}
+
+static struct mvs_pkt *mvs_pkt_alloc(u32 len, gfp_t gfp)
+{
+	struct mvs_pkt *pkt;
+
+	pkt = kmalloc(sizeof(*pkt) + len, gfp);
+	if (!pkt)
+		return NULL;
+
+	pkt->off = 0;
+	pkt->len = len;
+
+	return pkt;
+}
+
+/* The data channel sent or dropped the packet */
+static void mvs_tx_done(struct mango_dc_txbuf *tx)
+{
+	kfree(tx->priv);
+}
+
+/*
+ * The data channel sends one request completely before the next one, so
+ * packets never interleave in the stream.
+ */
+static void mvs_queue(struct mvs_link *link, struct mvs_pkt *pkt)
+{
+	pkt->tx.data = (const unsigned char *)&pkt->hdr;
+	pkt->tx.len  = sizeof(pkt->hdr) + pkt->len;
+	pkt->tx.done = mvs_tx_done;
+	pkt->tx.priv = pkt;
+
+	if (mango_dc_submit(link->client, &pkt->tx))
+		kfree(pkt);
+}
+
+static void mvs_fill_hdr(struct mvs_pkt *pkt, u32 src_port, u32 dst_port,
+			 u16 op, u16 flags, struct mvs_trans *t)
+{
+	pkt->hdr.src_port  = cpu_to_le32(src_port);
+	pkt->hdr.dst_port  = cpu_to_le32(dst_port);
+	pkt->hdr.len       = cpu_to_le32(pkt->len);
+	pkt->hdr.op        = cpu_to_le16(op);
+	pkt->hdr.flags     = cpu_to_le16(flags);
+	pkt->hdr.buf_alloc = cpu_to_le32(t ? t->buf_alloc : 0);
+	pkt->hdr.fwd_cnt   = cpu_to_le32(t ? t->fwd_cnt : 0);
+
+	if (t)
+		t->last_fwd_cnt = t->fwd_cnt;
+}
+
+/* Send a packet without payload on behalf of a socket */
+static int mvs_send_ctrl(struct vsock_sock *vsk, u16 op, u16 flags)
+{
+	struct mvs_link *link = mvs_link_by_cid(vsk->remote_addr.svm_cid);
+	struct mvs_pkt *pkt;
+
+	if (!link)
+		return -ENETUNREACH;
+
+	pkt = mvs_pkt_alloc(0, GFP_KERNEL);
+	if (!pkt)
+		return -ENOMEM;
+
+	mvs_fill_hdr(pkt, vsk->local_addr.svm_port, vsk->remote_addr.svm_port,
+		     op, flags, mvs_trans(vsk));
+	mvs_queue(link, pkt);
+
+	return 0;
+}
+
+/* Refuse a packet nobody is listening for */
+static void mvs_send_rst(struct mvs_link *link, struct mango_vsock_hdr *hdr)
+{
+	struct mvs_pkt *pkt;
+
+	if (le16_to_cpu(hdr->op) == MANGO_VSOCK_OP_RST)
+		return;
+
+	pkt = mvs_pkt_alloc(0, GFP_KERNEL);
+	if (!pkt)
+		return;
+
+	mvs_fill_hdr(pkt, le32_to_cpu(hdr->dst_port), le32_to_cpu(hdr->src_port),
+		     MANGO_VSOCK_OP_RST, 0, NULL);
+	mvs_queue(link, pkt);
+}
+
+static void mvs_update_credit(struct mvs_trans *t, struct mango_vsock_hdr *hdr)
+{
+	t->peer_buf_alloc = le32_to_cpu(hdr->buf_alloc);
+	t->peer_fwd_cnt   = le32_to_cpu(hdr->fwd_cnt);
+}
+
+static void mvs_purge_rx(struct mvs_trans *t)
+{
+	struct mvs_pkt *pkt, *tmp;
+
+	list_for_each_entry_safe(pkt, tmp, &t->rx_queue, list) {
+		list_del(&pkt->list);
+		kfree(pkt);
+	}
+
+	t->rx_bytes = 0;
+}
+
+/* Connection request on a listening socket */
+static void mvs_recv_listen(struct sock *sk, struct mvs_link *link,
+			    struct mvs_pkt *pkt)
+{
+	struct vsock_sock *vchild;
+	struct sock *child;
+
+	if (le16_to_cpu(pkt->hdr.op) != MANGO_VSOCK_OP_REQUEST) {
+		mvs_send_rst(link, &pkt->hdr);
+		return;
+	}
+
+	if (sk_acceptq_is_full(sk)) {
+		mvs_send_rst(link, &pkt->hdr);
+		return;
+	}
+
+	child = __vsock_create(sock_net(sk), NULL, sk, GFP_KERNEL, sk->sk_type);
+	if (!child) {
+		mvs_send_rst(link, &pkt->hdr);
+		return;
+	}
+
+	sk->sk_ack_backlog++;
+
+	lock_sock_nested(child, SINGLE_DEPTH_NESTING);
+
+	child->sk_state = SS_CONNECTED;
+
+	vchild = vsock_sk(child);
+	vsock_addr_init(&vchild->local_addr, mvs_local_cid,
+			le32_to_cpu(pkt->hdr.dst_port));
+	vsock_addr_init(&vchild->remote_addr, link->dest + MANGO_VSOCK_CID_BASE,
+			le32_to_cpu(pkt->hdr.src_port));
+	mvs_update_credit(mvs_trans(vchild), &pkt->hdr);
+
+	vsock_insert_connected(vchild);
+	vsock_enqueue_accept(sk, child);
+	mvs_send_ctrl(vchild, MANGO_VSOCK_OP_RESPONSE, 0);
+
+	release_sock(child);
+
+	sk->sk_data_ready(sk);
+}
+
+/* Packet for a connected or connecting socket, returns true if kept */
+static bool mvs_recv_connected(struct sock *sk, struct mvs_pkt *pkt)
+{
+	struct vsock_sock *vsk = vsock_sk(sk);
+	struct mvs_trans *t = mvs_trans(vsk);
+
+	mvs_update_credit(t, &pkt->hdr);
+
+	switch (le16_to_cpu(pkt->hdr.op)) {
+	case MANGO_VSOCK_OP_RESPONSE:
+		if (sk->sk_state != SS_CONNECTING)
+			break;
+		sk->sk_state = SS_CONNECTED;
+		sk->sk_socket->state = SS_CONNECTED;
+		vsock_insert_connected(vsk);
+		sk->sk_state_change(sk);
+		break;
+
+	case MANGO_VSOCK_OP_RW:
+		if (sk->sk_state != SS_CONNECTED || !pkt->len)
+			break;
+		list_add_tail(&pkt->list, &t->rx_queue);
+		t->rx_bytes += pkt->len;
+		sk->sk_data_ready(sk);
+		return true;
+
+	case MANGO_VSOCK_OP_CREDIT:
+		sk->sk_write_space(sk);
+		break;
+
+	case MANGO_VSOCK_OP_SHUTDOWN:
+		vsk->peer_shutdown |= le16_to_cpu(pkt->hdr.flags) & SHUTDOWN_MASK;
+		sk->sk_state_change(sk);
+		break;
+
+	case MANGO_VSOCK_OP_RST:
+		if (sk->sk_state == SS_CONNECTING) {
+			sk->sk_state = SS_UNCONNECTED;
+			sk->sk_err = ECONNREFUSED;
+			sk->sk_error_report(sk);
+			break;
+		}
+		sock_set_flag(sk, SOCK_DONE);
+		vsk->peer_shutdown = SHUTDOWN_MASK;
+		sk->sk_state = SS_DISCONNECTING;
+		sk->sk_state_change(sk);
+		break;
+	}
+
+	return false;
+}
+
+/* Deliver a received packet, called from the IRQ thread */
+static void mvs_recv_pkt(struct mvs_link *link, struct mvs_pkt *pkt)
+{
+	struct sockaddr_vm src, dst;
+	struct sock *sk;
+	bool kept = false;
+
+	vsock_addr_init(&src, link->dest + MANGO_VSOCK_CID_BASE,
+			le32_to_cpu(pkt->hdr.src_port));
+	vsock_addr_init(&dst, mvs_local_cid, le32_to_cpu(pkt->hdr.dst_port));
+
+	sk = vsock_find_connected_socket(&src, &dst);
+	if (!sk) {
+		sk = vsock_find_bound_socket(&dst);
+		if (!sk) {
+			mvs_send_rst(link, &pkt->hdr);
+			goto out;
+		}
+	}
+
+	lock_sock(sk);
+
+	if (sk->sk_state == VSOCK_SS_LISTEN)
+		mvs_recv_listen(sk, link, pkt);
+	else
+		kept = mvs_recv_connected(sk, pkt);
+
+	release_sock(sk);
+	sock_put(sk);
+
+out:
+	if (!kept)
+		kfree(pkt);
+}
+
+/* Parse the channel byte stream into packets, called from the IRQ thread */
+static void mvs_rx(void *priv, const unsigned char *data, unsigned int len)
+{
+	struct mvs_link *link = priv;
+	struct mvs_pkt *pkt;
+	unsigned int count;
+	u32 plen;
+
+	/* Data arriving while the link is set up has no one to go to */
+	if (!ACCESS_ONCE(link->ready))
+		return;
+	smp_rmb();
+
+	while (len) {
+		/* Payload of a packet which could not be allocated */
+		if (link->rx_skip) {
+			count = min_t(u32, len, link->rx_skip);
+			link->rx_skip -= count;
+			data += count;
+			len  -= count;
+			continue;
+		}
+
+		pkt = link->rx_pkt;
+
+		if (!pkt) {
+			count = min_t(unsigned int, len,
+				      sizeof(link->rx_hdr) - link->rx_hdr_len);
+			memcpy((unsigned char *)&link->rx_hdr + link->rx_hdr_len,
+			       data, count);
+			link->rx_hdr_len += count;
+			data += count;
+			len  -= count;
+
+			if (link->rx_hdr_len < sizeof(link->rx_hdr))
+				break;
+
+			link->rx_hdr_len = 0;
+
+			plen = le32_to_cpu(link->rx_hdr.len);
+			if (plen > MANGO_VSOCK_MAX_PKT) {
+				printk(KERN_ALERT "mango_vsock: bad packet from partition %d\n",
+				       link->dest);
+				link->rx_skip = plen;
+				continue;
+			}
+
+			pkt = mvs_pkt_alloc(plen, GFP_KERNEL);
+			if (!pkt) {
+				link->rx_skip = plen;
+				continue;
+			}
+
+			pkt->hdr = link->rx_hdr;
+			link->rx_pkt = pkt;
+		} else {
+			count = min_t(unsigned int, len, pkt->len - pkt->off);
+			memcpy(pkt->data + pkt->off, data, count);
+			pkt->off += count;
+			data += count;
+			len  -= count;
+		}
+
+		if (pkt->off == pkt->len) {
+			link->rx_pkt = NULL;
+			pkt->off = 0;
+			mvs_recv_pkt(link, pkt);
+		}
+	}
+}
+
+static const struct mango_dc_client_ops mvs_dc_ops = {
+	.rx = mvs_rx,
+};
+
+/*********************************/
+/*       vsock transport         */
+/*********************************/
+
+static int mvs_init(struct vsock_sock *vsk, struct vsock_sock *psk)
+{
+	struct mvs_trans *t;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&t->rx_queue);
+
+	if (psk) {
+		t->buf_alloc = mvs_trans(psk)->buf_alloc;
+		t->buf_min   = mvs_trans(psk)->buf_min;
+		t->buf_max   = mvs_trans(psk)->buf_max;
+	} else {
+		t->buf_alloc = MANGO_VSOCK_BUF_SIZE;
+		t->buf_min   = MANGO_VSOCK_BUF_MIN;
+		t->buf_max   = MANGO_VSOCK_BUF_MAX;
+	}
+
+	vsk->trans = t;
+
+	return 0;
+}
+
+static void mvs_destruct(struct vsock_sock *vsk)
+{
+	struct mvs_trans *t = mvs_trans(vsk);
+
+	mvs_purge_rx(t);
+	kfree(t);
+}
+
+static void mvs_release(struct vsock_sock *vsk)
+{
+	struct sock *sk = sk_vsock(vsk);
+
+	lock_sock(sk);
+
+	if (sk->sk_type == SOCK_STREAM && sk->sk_state == SS_CONNECTED &&
+	    vsk->peer_shutdown != SHUTDOWN_MASK)
+		mvs_send_ctrl(vsk, MANGO_VSOCK_OP_RST, 0);
+
+	mvs_purge_rx(mvs_trans(vsk));
+
+	release_sock(sk);
+}
+
+static int mvs_connect(struct vsock_sock *vsk)
+{
+	return mvs_send_ctrl(vsk, MANGO_VSOCK_OP_REQUEST, 0);
+}
+
+static int mvs_shutdown(struct vsock_sock *vsk, int mode)
+{
+	return mvs_send_ctrl(vsk, MANGO_VSOCK_OP_SHUTDOWN, mode & SHUTDOWN_MASK);
+}
+
+static int mvs_dgram_bind(struct vsock_sock *vsk, struct sockaddr_vm *addr)
+{
+	return -EOPNOTSUPP;
+}
+
+static int mvs_dgram_dequeue(struct kiocb *kiocb, struct vsock_sock *vsk,
+			     struct msghdr *msg, size_t len, int flags)
+{
+	return -EOPNOTSUPP;
+}
+
+static int mvs_dgram_enqueue(struct vsock_sock *vsk, struct sockaddr_vm *addr,
+			     struct iovec *iov, size_t len)
+{
+	return -EOPNOTSUPP;
+}
+
+static bool mvs_dgram_allow(u32 cid, u32 port)
+{
+	return false;
+}
+
+static ssize_t mvs_stream_dequeue(struct vsock_sock *vsk, struct iovec *iov,
+				  size_t len, int flags)
+{
+	struct mvs_trans *t = mvs_trans(vsk);
+	struct mvs_pkt *pkt, *tmp;
+	size_t done = 0, count;
+	int err;
+
+	list_for_each_entry_safe(pkt, tmp, &t->rx_queue, list) {
+		if (done == len)
+			break;
+
+		count = min_t(size_t, len - done, pkt->len - pkt->off);
+
+		if (flags & MSG_PEEK) {
+			err = memcpy_toiovecend(iov, pkt->data + pkt->off,
+						done, count);
+			if (err)
+				return done ? done : err;
+			done += count;
+			continue;
+		}
+
+		err = memcpy_toiovec(iov, pkt->data + pkt->off, count);
+		if (err)
+			return done ? done : err;
+
+		done       += count;
+		pkt->off   += count;
+		t->rx_bytes -= count;
+		t->fwd_cnt  += count;
+
+		if (pkt->off == pkt->len) {
+			list_del(&pkt->list);
+			kfree(pkt);
+		}
+	}
+
+	/* Return credit once a quarter of the buffer was consumed */
+	if (!(flags & MSG_PEEK) &&
+	    (t->fwd_cnt - t->last_fwd_cnt >= t->buf_alloc / 4 || !t->rx_bytes) &&
+	    t->fwd_cnt != t->last_fwd_cnt)
+		mvs_send_ctrl(vsk, MANGO_VSOCK_OP_CREDIT, 0);
+
+	return done;
+}
+
+static s64 mvs_stream_has_space(struct vsock_sock *vsk)
+{
+	struct mvs_trans *t = mvs_trans(vsk);
+	s64 space;
+
+	space = (s64)t->peer_buf_alloc - (s64)(u32)(t->tx_cnt - t->peer_fwd_cnt);
+
+	return (space < 0) ? 0 : space;
+}
+
+static ssize_t mvs_stream_enqueue(struct vsock_sock *vsk, struct iovec *iov,
+				  size_t len)
+{
+	struct mvs_link *link = mvs_link_by_cid(vsk->remote_addr.svm_cid);
+	struct mvs_trans *t = mvs_trans(vsk);
+	struct mvs_pkt *pkt;
+	size_t count;
+
+	if (!link)
+		return -ENETUNREACH;
+
+	count = min_t(size_t, len, mvs_stream_has_space(vsk));
+	count = min_t(size_t, count, MANGO_VSOCK_MAX_PKT);
+	if (!count)
+		return 0;
+
+	pkt = mvs_pkt_alloc(count, GFP_KERNEL);
+	if (!pkt)
+		return -ENOMEM;
+
+	if (memcpy_fromiovec(pkt->data, iov, count)) {
+		kfree(pkt);
+		return -EFAULT;
+	}
+
+	mvs_fill_hdr(pkt, vsk->local_addr.svm_port, vsk->remote_addr.svm_port,
+		     MANGO_VSOCK_OP_RW, 0, t);
+	t->tx_cnt += count;
+
+	mvs_queue(link, pkt);
+
+	return count;
+}
+
+static s64 mvs_stream_has_data(struct vsock_sock *vsk)
+{
+	return mvs_trans(vsk)->rx_bytes;
+}
+
+static u64 mvs_stream_rcvhiwat(struct vsock_sock *vsk)
+{
+	return mvs_trans(vsk)->buf_alloc;
+}
+
+static bool mvs_stream_is_active(struct vsock_sock *vsk)
+{
+	return sk_vsock(vsk)->sk_state == SS_CONNECTED;
+}
+
+static bool mvs_stream_allow(u32 cid, u32 port)
+{
+	return mvs_link_by_cid(cid) != NULL;
+}
+
+static int mvs_notify_poll_in(struct vsock_sock *vsk, size_t target,
+			      bool *data_ready_now)
+{
+	*data_ready_now = vsock_stream_has_data(vsk) >= target;
+
+	return 0;
+}
+
+static int mvs_notify_poll_out(struct vsock_sock *vsk, size_t target,
+			       bool *space_avail_now)
+{
+	*space_avail_now = vsock_stream_has_space(vsk) > 0;
+
+	return 0;
+}
+
+static int mvs_notify_recv(struct vsock_sock *vsk, size_t target,
+			   struct vsock_transport_recv_notify_data *data)
+{
+	return 0;
+}
+
+static int mvs_notify_recv_post_dequeue(struct vsock_sock *vsk, size_t target,
+					ssize_t copied, bool data_read,
+					struct vsock_transport_recv_notify_data *data)
+{
+	return 0;
+}
+
+static int mvs_notify_send(struct vsock_sock *vsk,
+			   struct vsock_transport_send_notify_data *data)
+{
+	return 0;
+}
+
+static int mvs_notify_send_post_enqueue(struct vsock_sock *vsk, ssize_t written,
+					struct vsock_transport_send_notify_data *data)
+{
+	return 0;
+}
+
+static void mvs_set_buffer_size(struct vsock_sock *vsk, u64 val)
+{
+	struct mvs_trans *t = mvs_trans(vsk);
+
+	t->buf_alloc = clamp_t(u64, val, t->buf_min, t->buf_max);
+}
+
+static void mvs_set_min_buffer_size(struct vsock_sock *vsk, u64 val)
+{
+	struct mvs_trans *t = mvs_trans(vsk);
+
+	t->buf_min = min_t(u64, val, MANGO_VSOCK_BUF_MAX);
+	if (t->buf_alloc < t->buf_min)
+		t->buf_alloc = t->buf_min;
+}
+
+static void mvs_set_max_buffer_size(struct vsock_sock *vsk, u64 val)
+{
+	struct mvs_trans *t = mvs_trans(vsk);
+
+	t->buf_max = min_t(u64, val, MANGO_VSOCK_BUF_MAX);
+	if (t->buf_alloc > t->buf_max)
+		t->buf_alloc = t->buf_max;
+}
+
+static u64 mvs_get_buffer_size(struct vsock_sock *vsk)
+{
+	return mvs_trans(vsk)->buf_alloc;
+}
+
+static u64 mvs_get_min_buffer_size(struct vsock_sock *vsk)
+{
+	return mvs_trans(vsk)->buf_min;
+}
+
+static u64 mvs_get_max_buffer_size(struct vsock_sock *vsk)
+{
+	return mvs_trans(vsk)->buf_max;
+}
+
+static u32 mvs_get_local_cid(void)
+{
+	return mvs_local_cid;
+}
+
+static const struct vsock_transport mvs_transport = {
+	.init                     = mvs_init,
+	.destruct                 = mvs_destruct,
+	.release                  = mvs_release,
+	.connect                  = mvs_connect,
+	.dgram_bind               = mvs_dgram_bind,
+	.dgram_dequeue            = mvs_dgram_dequeue,
+	.dgram_enqueue            = mvs_dgram_enqueue,
+	.dgram_allow              = mvs_dgram_allow,
+	.stream_dequeue           = mvs_stream_dequeue,
+	.stream_enqueue           = mvs_stream_enqueue,
+	.stream_has_data          = mvs_stream_has_data,
+	.stream_has_space         = mvs_stream_has_space,
+	.stream_rcvhiwat          = mvs_stream_rcvhiwat,
+	.stream_is_active         = mvs_stream_is_active,
+	.stream_allow             = mvs_stream_allow,
+	.notify_poll_in           = mvs_notify_poll_in,
+	.notify_poll_out          = mvs_notify_poll_out,
+	.notify_recv_init         = mvs_notify_recv,
+	.notify_recv_pre_block    = mvs_notify_recv,
+	.notify_recv_pre_dequeue  = mvs_notify_recv,
+	.notify_recv_post_dequeue = mvs_notify_recv_post_dequeue,
+	.notify_send_init         = mvs_notify_send,
+	.notify_send_pre_block    = mvs_notify_send,
+	.notify_send_pre_enqueue  = mvs_notify_send,
+	.notify_send_post_enqueue = mvs_notify_send_post_enqueue,
+	.shutdown                 = mvs_shutdown,
+	.set_buffer_size          = mvs_set_buffer_size,
+	.set_min_buffer_size      = mvs_set_min_buffer_size,
+	.set_max_buffer_size      = mvs_set_max_buffer_size,
+	.get_buffer_size          = mvs_get_buffer_size,
+	.get_min_buffer_size      = mvs_get_min_buffer_size,
+	.get_max_buffer_size      = mvs_get_max_buffer_size,
+	.get_local_cid            = mvs_get_local_cid,
+};
+
+static void mvs_link_close(struct mvs_link *link)
+{
+	/* Stops the receive callbacks and drops the queued packets */
+	mango_dc_detach(link->client);
+
+	kfree(link->rx_pkt);
+}
+
+static int mvs_link_open(struct mvs_link *link, int ch)
+{
+	struct mango_dc_client *client;
+	int ret;
+
+	link->ch         = ch;
+	link->rx_hdr_len = 0;
+	link->rx_pkt     = NULL;
+	link->rx_skip    = 0;
+	link->ready      = 0;
+
+	/* Fails if the channel is missing or already in use */
+	client = mango_dc_attach(ch, &mvs_dc_ops, link);
+	if (IS_ERR(client)) {
+		printk(KERN_ALERT "mango_vsock: failed to attach dc#%d with %ld\n",
+		       ch, PTR_ERR(client));
+		return PTR_ERR(client);
+	}
+
+	ret = mango_dc_client_set_mode(client, MANGO_DC_MODE_STREAM);
+	if (ret) {
+		printk(KERN_ALERT "mango_vsock: failed to set stream mode on dc#%d\n", ch);
+		mango_dc_detach(client);
+		return ret;
+	}
+
+	link->client = client;
+	link->dest   = mango_dc_client_get_dest(client);
+
+	/* Pairs with mvs_rx(), which may already run */
+	smp_wmb();
+	ACCESS_ONCE(link->ready) = 1;
+
+	return 0;
+}
+
+static void __exit mvs_module_exit(void)
+{
+	int i;
+
+	vsock_core_exit();
+
+	for (i = 0; i < nr_channels; i++)
+		mvs_link_close(&mvs_links[i]);
+}
+
+static int __init mvs_module_init(void)
+{
+	int i, ret;
+
+	if (!nr_channels) {
+		printk(KERN_ALERT "mango_vsock: no data channels given\n");
+		return -EINVAL;
+	}
+
+	mvs_local_cid = mango_get_partition_id() + MANGO_VSOCK_CID_BASE;
+
+	for (i = 0; i < nr_channels; i++) {
+		ret = mvs_link_open(&mvs_links[i], channels[i]);
+		if (ret)
+			goto out;
+	}
+
+	ret = vsock_core_init(&mvs_transport);
+	if (ret)
+		goto out;
+
+	printk("mango_vsock: local CID %u, %d peers\n", mvs_local_cid, nr_channels);
+
+	return 0;
+
+out:
+	while (i--)
+		mvs_link_close(&mvs_links[i]);
+
+	return ret;
+}
+
+module_init(mvs_module_init);
+module_exit(mvs_module_exit);
+
+module_param_array(channels, int, &nr_channels, S_IRUGO);
+MODULE_PARM_DESC(channels, "data channels to the peers, one per peer partition");
+
+MODULE_AUTHOR("Alexander Smirnov");
+MODULE_DESCRIPTION("Mango VSOCK Transport");
+MODULE_LICENSE("GPL");
+/* Hypercalls are inline, mango_core must unlock Mango first */
+MODULE_SOFTDEP("pre: mango_core");
@@ -1,7 +1,7 @@
 /*
  * Linux driver for Mango Watchdog.
  *
- * Copyright (c) 2014-2015 ilbers GmbH
+ * Copyright (c) 2014-2016 ilbers GmbH
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License version 2
@@ -17,115 +17,304 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
-#include <linux/cpu.h>
+#include <linux/atomic.h>
+#include <linux/hrtimer.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
-#include <linux/fs.h>
+#include <linux/spinlock.h>
+#include <linux/watchdog.h>
+#include <linux/workqueue.h>
 #include <asm/uaccess.h>
-#include <linux/sched.h>
 
 #include <mango.h>
 
-#define CLASS_NAME	"mango_wd"	/* Device class name */
-#define DEVICE_NAME	"wd"		/* Device name as it appears in /proc/devices */
+#define WD_DEFAULT_TIMEOUT	30	/* Seconds */
+#define WD_MAX_TIMEOUT		3600	/* Seconds */
 
 struct wd_dev_t {
-	int           is_open;		/* Device open flag */
-	int           major;
-	struct class  *class_wd;
-	struct device *dev;
+	struct watchdog_device wdd;
+	unsigned int           pretimeout;	/* Seconds before timeout, 0 if off */
+	ktime_t                last_ping;	/* Last ping passed to Mango */
+	spinlock_t             lock;		/* Protects last_ping */
+	struct hrtimer         pretimer;	/* Fires at the pretimeout */
+	struct hrtimer         heartbeat;	/* Kernel heartbeat */
+	struct work_struct     hb_work;	/* Proves that tasks get scheduled */
+	atomic_t               hb_alive;	/* Set by hb_work */
 };
 
 static struct wd_dev_t wd_dev;
 
-static int wd_open(struct inode *inode, struct file *filep)
+static unsigned int timeout = WD_DEFAULT_TIMEOUT;
+static unsigned int pretimeout;
+static bool pretimeout_panic;
+static unsigned int ping_interval_ms = 1000;
+static unsigned int heartbeat_ms;
+static bool nowayout = WATCHDOG_NOWAYOUT;
+
+/* Pings closer than this reach Mango only once, at most timeout / 4 */
+static s64 wd_ping_interval_us(struct wd_dev_t *wd)
+{
+	return min_t(s64, ping_interval_ms * 1000LL,
+		     wd->wdd.timeout * USEC_PER_SEC / 4);
+}
+
+static ktime_t wd_heartbeat_period(void)
+{
+	return ns_to_ktime((u64)heartbeat_ms * NSEC_PER_MSEC);
+}
+
+static void wd_arm_pretimeout(struct wd_dev_t *wd)
 {
-	if (wd_dev.is_open)
-		return -EBUSY;
+	if (!wd->pretimeout)
+		return;
+
+	hrtimer_start(&wd->pretimer,
+		      ktime_set(wd->wdd.timeout - wd->pretimeout, 0),
+		      HRTIMER_MODE_REL);
+}
+
+/*
+ * Ping Mango, coalescing pings which come in faster than the ping interval.
+ * Safe from any context, the kernel heartbeat calls it from its hrtimer.
+ */
+static int wd_do_ping(struct wd_dev_t *wd)
+{
+	unsigned long flags;
+	ktime_t now = ktime_get();
+
+	spin_lock_irqsave(&wd->lock, flags);
+
+	if (ktime_us_delta(now, wd->last_ping) < wd_ping_interval_us(wd)) {
+		spin_unlock_irqrestore(&wd->lock, flags);
+		return 0;
+	}
+
+	wd->last_ping = now;
+
+	spin_unlock_irqrestore(&wd->lock, flags);
 
-	wd_dev.is_open = 1;
+	if (mango_watchdog_ping())
+		return -EIO;
+
+	wd_arm_pretimeout(wd);
 
 	return 0;
 }
 
-static int wd_release(struct inode *inode, struct file *filep)
+static int wd_start(struct watchdog_device *wdd)
 {
-	wd_dev.is_open = 0;
+	struct wd_dev_t *wd = watchdog_get_drvdata(wdd);
+
+	if (mango_watchdog_start())
+		return -EIO;
+
+	wd->last_ping = ktime_get();
+	wd_arm_pretimeout(wd);
 
 	return 0;
 }
 
-static ssize_t wd_write(struct file *filep,
-			const char *buff,
-			size_t len,
-			loff_t *off)
+static int wd_stop(struct watchdog_device *wdd)
 {
-	int ret;
+	struct wd_dev_t *wd = watchdog_get_drvdata(wdd);
 
-	ret = mango_watchdog_ping();
-	if (ret)
-		return 0;
+	hrtimer_cancel(&wd->pretimer);
+
+	return mango_watchdog_stop() ? -EIO : 0;
+}
+
+static int wd_ping(struct watchdog_device *wdd)
+{
+	return wd_do_ping(watchdog_get_drvdata(wdd));
+}
+
+static int wd_set_timeout(struct watchdog_device *wdd, unsigned int t)
+{
+	struct wd_dev_t *wd = watchdog_get_drvdata(wdd);
+
+	if (mango_watchdog_set_timeout(t))
+		return -EIO;
+
+	wdd->timeout = t;
+
+	if (wd->pretimeout >= t)
+		wd->pretimeout = 0;
+
+	/* Restart the period with the new timeout */
+	wd->last_ping = ktime_set(0, 0);
+
+	return wd_do_ping(wd);
+}
+
+static unsigned int wd_get_timeleft(struct watchdog_device *wdd)
+{
+	struct wd_dev_t *wd = watchdog_get_drvdata(wdd);
+	s64 elapsed = ktime_us_delta(ktime_get(), wd->last_ping) / USEC_PER_SEC;
+
+	return (elapsed < wdd->timeout) ? wdd->timeout - elapsed : 0;
+}
+
+static long wd_ioctl(struct watchdog_device *wdd, unsigned int cmd,
+		     unsigned long arg)
+{
+	struct wd_dev_t *wd = watchdog_get_drvdata(wdd);
+	int __user *p = (int __user *)arg;
+	int val;
+
+	switch (cmd) {
+	case WDIOC_SETPRETIMEOUT:
+		if (get_user(val, p))
+			return -EFAULT;
+		if (val < 0 || val >= wdd->timeout)
+			return -EINVAL;
+		wd->pretimeout = val;
+		if (!val)
+			hrtimer_cancel(&wd->pretimer);
+		else if (watchdog_active(wdd))
+			wd_arm_pretimeout(wd);
+		/* Fall through */
+	case WDIOC_GETPRETIMEOUT:
+		return put_user(wd->pretimeout, p);
+	default:
+		return -ENOIOCTLCMD;
+	}
+}
+
+static enum hrtimer_restart wd_pretimeout_fn(struct hrtimer *timer)
+{
+	struct wd_dev_t *wd = container_of(timer, struct wd_dev_t, pretimer);
+
+	if (pretimeout_panic)
+		panic("mango_wd: watchdog pretimeout, %u s left\n",
+		      wd->pretimeout);
+
+	printk(KERN_EMERG "mango_wd: watchdog pretimeout, %u s left\n",
+	       wd->pretimeout);
+
+	return HRTIMER_NORESTART;
+}
+
+static void wd_hb_work(struct work_struct *work)
+{
+	struct wd_dev_t *wd = container_of(work, struct wd_dev_t, hb_work);
+
+	atomic_set(&wd->hb_alive, 1);
+}
+
+/*
+ * Kernel heartbeat. Mango is pinged only if the heartbeat work queued on the
+ * previous tick has run meanwhile, so a stalled scheduler lets the watchdog
+ * expire even though timer interrupts still arrive.
+ */
+static enum hrtimer_restart wd_heartbeat_fn(struct hrtimer *timer)
+{
+	struct wd_dev_t *wd = container_of(timer, struct wd_dev_t, heartbeat);
+
+	if (atomic_xchg(&wd->hb_alive, 0))
+		wd_do_ping(wd);
 	else
-		return 1;
+		printk_ratelimited(KERN_EMERG "mango_wd: scheduler stall, heartbeat withheld\n");
+
+	schedule_work(&wd->hb_work);
+
+	hrtimer_forward_now(timer, wd_heartbeat_period());
+
+	return HRTIMER_RESTART;
 }
 
-static struct file_operations wd_fops = {
-	.write   = wd_write,
-	.open    = wd_open,
-	.release = wd_release
+static const struct watchdog_info wd_info = {
+	.options          = WDIOF_SETTIMEOUT | WDIOF_KEEPALIVEPING |
+			    WDIOF_MAGICCLOSE | WDIOF_PRETIMEOUT,
+	.firmware_version = 0,
+	.identity         = "Mango Watchdog",
+};
+
+static const struct watchdog_ops wd_ops = {
+	.owner        = THIS_MODULE,
+	.start        = wd_start,
+	.stop         = wd_stop,
+	.ping         = wd_ping,
+	.set_timeout  = wd_set_timeout,
+	.get_timeleft = wd_get_timeleft,
+	.ioctl        = wd_ioctl,
 };
 
 void wd_module_exit(void)
 {
-	return;
+	hrtimer_cancel(&wd_dev.heartbeat);
+	cancel_work_sync(&wd_dev.hb_work);
+	hrtimer_cancel(&wd_dev.pretimer);
+
+	watchdog_unregister_device(&wd_dev.wdd);
 }
 
 int wd_module_init(void)
 {
-	void *ptr_err;
+	struct wd_dev_t *wd = &wd_dev;
+	int ret;
 
-	/* Register watchdog character device */
-        wd_dev.major = register_chrdev(0, DEVICE_NAME, &wd_fops);
-	if (wd_dev.major < 0) {
-		printk(KERN_ALERT "mango_wd: register watchdog failed with %d\n", wd_dev.major);
-		goto err;
-	}
+	spin_lock_init(&wd->lock);
+	hrtimer_init(&wd->pretimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	wd->pretimer.function = wd_pretimeout_fn;
+	hrtimer_init(&wd->heartbeat, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	wd->heartbeat.function = wd_heartbeat_fn;
+	INIT_WORK(&wd->hb_work, wd_hb_work);
+
+	wd->wdd.info        = &wd_info;
+	wd->wdd.ops         = &wd_ops;
+	wd->wdd.min_timeout = 1;
+	wd->wdd.max_timeout = WD_MAX_TIMEOUT;
+	wd->wdd.timeout     = WD_DEFAULT_TIMEOUT;
+
+	watchdog_init_timeout(&wd->wdd, timeout, NULL);
+	watchdog_set_nowayout(&wd->wdd, nowayout);
+	watchdog_set_drvdata(&wd->wdd, wd);
 
-	/* Create watchdog device class */
-	wd_dev.class_wd = class_create(THIS_MODULE, CLASS_NAME);
-	if (IS_ERR(ptr_err = wd_dev.class_wd)) {
-		printk(KERN_ALERT "mango_wd: failed to create device class\n");
-		goto err_unreg;
+	if (pretimeout < wd->wdd.timeout)
+		wd->pretimeout = pretimeout;
+
+	if (mango_watchdog_set_timeout(wd->wdd.timeout)) {
+		printk(KERN_ALERT "mango_wd: failed to set timeout\n");
+		return -EIO;
 	}
 
-	/* Create watchdog device */
-	wd_dev.dev = device_create(wd_dev.class_wd,
-				   NULL,
-				   MKDEV(wd_dev.major, 0),
-				   NULL,
-				   DEVICE_NAME);
-	if (IS_ERR(ptr_err = wd_dev.dev)) {
-		printk(KERN_ALERT "mango_wd: failed to create device class\n");
-		goto err_destroy;
+	ret = watchdog_register_device(&wd->wdd);
+	if (ret) {
+		printk(KERN_ALERT "mango_wd: register watchdog failed with %d\n", ret);
+		return ret;
 	}
 
-	wd_dev.is_open = 0;
+	/* Mango watchdog runs from load time on, as before */
+	wd_start(&wd->wdd);
 
-	mango_watchdog_start();
+	if (heartbeat_ms) {
+		atomic_set(&wd->hb_alive, 1);
+		hrtimer_start(&wd->heartbeat, wd_heartbeat_period(),
+			      HRTIMER_MODE_REL);
+	}
 
 	return 0;
-
-err_destroy:
-	class_destroy(wd_dev.class_wd);
-err_unreg:
-	unregister_chrdev(wd_dev.major, DEVICE_NAME);
-err:
-	return -EINVAL;
 }
 
 module_init(wd_module_init);
 module_exit(wd_module_exit);
 
+module_param(timeout, uint, 0);
+MODULE_PARM_DESC(timeout, "watchdog timeout in seconds");
+module_param(pretimeout, uint, 0);
+MODULE_PARM_DESC(pretimeout, "seconds before the timeout to warn, 0 disables");
+module_param(pretimeout_panic, bool, 0);
+MODULE_PARM_DESC(pretimeout_panic, "panic at the pretimeout instead of a warning");
+module_param(ping_interval_ms, uint, 0);
+MODULE_PARM_DESC(ping_interval_ms, "minimal interval between pings passed to Mango");
+module_param(heartbeat_ms, uint, 0);
+MODULE_PARM_DESC(heartbeat_ms, "kernel heartbeat period in ms, 0 disables");
+module_param(nowayout, bool, 0);
+MODULE_PARM_DESC(nowayout, "watchdog cannot be stopped once started");
+
 MODULE_AUTHOR("Alexander Smirnov");
 MODULE_DESCRIPTION("Mango Watchdog");
 MODULE_LICENSE("GPL");
+/* Hypercalls are inline, mango_core must unlock Mango first */
+MODULE_SOFTDEP("pre: mango_core");
@@ -20,40 +20,208 @@
 #ifndef __MANGO_H__
 #define __MANGO_H__
 
-/* Mango API */
-unsigned int mango_unlock(unsigned char *token);
-
-/* Data Channel */
-unsigned int mango_dc_open(unsigned int ch, unsigned int dest);
-unsigned int mango_dc_close(unsigned int ch);
-unsigned int mango_dc_write(unsigned int ch, const unsigned char *p, unsigned int len);
-unsigned int mango_dc_read(unsigned int ch, unsigned char *p, unsigned int len);
-unsigned int mango_dc_tx_free_space(unsigned int ch);
-unsigned int mango_dc_reset(unsigned int ch);
-unsigned int mango_dc_set_mode(unsigned int ch, unsigned int mode);
-
-/* Partition Management */
-unsigned int mango_get_partition_id(void);
-unsigned int mango_partition_reset(void);
-unsigned int mango_get_partition_run_time(void);
-
-/* Watchdog */
-unsigned int mango_watchdog_start(void);
-unsigned int mango_watchdog_ping(void);
-unsigned int mango_watchdog_set_timeout(unsigned int timeout);
-
-/* Networking */
-unsigned int mango_net_open(unsigned int iface);
-unsigned int mango_net_tx(unsigned int iface,
-			  unsigned int dest,
-			  const unsigned char *p,
-			  unsigned int len);
-unsigned int mango_net_rx(unsigned int iface,
-			  unsigned char *p,
-			  unsigned int len);
-unsigned int mango_net_close(unsigned int iface);
-unsigned int mango_net_set_mode(unsigned int iface, unsigned int mode);
-unsigned int mango_net_get_rx_size(unsigned int iface);
-unsigned int mango_net_reset(unsigned int iface);
+/* Mango hypercall identifiers, should be the same as in Mango core */
+#define MANGO_HVC_AUTH			0x01
+
+#define MANGO_HVC_DC_OPEN		0x10
+#define MANGO_HVC_DC_WRITE		0x11
+#define MANGO_HVC_DC_READ		0x12
+#define MANGO_HVC_DC_CLOSE		0x13
+#define MANGO_HVC_DC_TX_FREE_SPACE	0x14
+#define MANGO_HVC_DC_RESET		0x15
+#define MANGO_HVC_DC_SET_MODE		0x16
+
+#define MANGO_HVC_PARTITION_ID		0x20
+#define MANGO_HVC_PARTITION_RESET	0x21
+#define MANGO_HVC_PARTITION_RUN_TIME	0x22
+
+#define MANGO_HVC_WD_START		0x30
+#define MANGO_HVC_WD_STOP		0x31
+#define MANGO_HVC_WD_PING		0x32
+#define MANGO_HVC_WD_SET_TIMEOUT	0x33
+
+#define MANGO_HVC_CONSOLE_WRITE		0x40
+
+#define MANGO_HVC_DEBUG			0x50
+
+#define MANGO_HVC_NET_OPEN		0x61
+#define MANGO_HVC_NET_SET_MODE		0x62
+#define MANGO_HVC_NET_TX		0x63
+#define MANGO_HVC_NET_RX		0x64
+#define MANGO_HVC_NET_CLOSE		0x65
+#define MANGO_HVC_NET_RX_SIZE		0x66
+#define MANGO_HVC_NET_RESET		0x67
+
+#define MANGO_HVC_SHM_NOTIFY		0x70
+
+/*
+ * Hypercall table: name, identifier, number of arguments, clobbers,
+ * prototype, arguments.
+ *
+ * Arguments are passed in r0-r3 and the result is returned in r0. As for
+ * an AAPCS call, Mango may change r0-r3 and r12 (ip) and preserves all the
+ * other registers, so the argument registers a call does not use and ip
+ * are clobbered as well. Calls with "mem" clobbers pass buffers to Mango,
+ * or publish guest memory to another partition, so the compiler must not
+ * keep memory contents in registers across the call. All other calls
+ * touch no guest memory and leave the compiler free to do so.
+ */
+#define MANGO_HVC_TABLE(X)						\
+	X(mango_unlock, MANGO_HVC_AUTH, 1, mem,				\
+	  (unsigned char *token), (token))				\
+									\
+	X(mango_dc_open, MANGO_HVC_DC_OPEN, 2, none,			\
+	  (unsigned int ch, unsigned int dest), (ch, dest))		\
+	X(mango_dc_close, MANGO_HVC_DC_CLOSE, 1, none,			\
+	  (unsigned int ch), (ch))					\
+	X(mango_dc_write, MANGO_HVC_DC_WRITE, 3, mem,			\
+	  (unsigned int ch, const unsigned char *p, unsigned int len),	\
+	  (ch, p, len))							\
+	X(mango_dc_read, MANGO_HVC_DC_READ, 3, mem,			\
+	  (unsigned int ch, unsigned char *p, unsigned int len),	\
+	  (ch, p, len))							\
+	X(mango_dc_tx_free_space, MANGO_HVC_DC_TX_FREE_SPACE, 1, none,	\
+	  (unsigned int ch), (ch))					\
+	X(mango_dc_reset, MANGO_HVC_DC_RESET, 1, none,			\
+	  (unsigned int ch), (ch))					\
+	X(mango_dc_set_mode, MANGO_HVC_DC_SET_MODE, 2, none,		\
+	  (unsigned int ch, unsigned int mode), (ch, mode))		\
+									\
+	X(mango_get_partition_id, MANGO_HVC_PARTITION_ID, 0, none,	\
+	  (void), ())							\
+	X(mango_partition_reset, MANGO_HVC_PARTITION_RESET, 0, none,	\
+	  (void), ())							\
+	X(mango_get_partition_run_time, MANGO_HVC_PARTITION_RUN_TIME,	\
+	  0, none, (void), ())						\
+									\
+	X(mango_watchdog_start, MANGO_HVC_WD_START, 0, none,		\
+	  (void), ())							\
+	X(mango_watchdog_stop, MANGO_HVC_WD_STOP, 0, none,		\
+	  (void), ())							\
+	X(mango_watchdog_ping, MANGO_HVC_WD_PING, 0, none,		\
+	  (void), ())							\
+	X(mango_watchdog_set_timeout, MANGO_HVC_WD_SET_TIMEOUT, 1, none,	\
+	  (unsigned int timeout), (timeout))				\
+									\
+	X(mango_console_write, MANGO_HVC_CONSOLE_WRITE, 2, mem,		\
+	  (const char *p, unsigned int len), (p, len))			\
+									\
+	X(mango_net_open, MANGO_HVC_NET_OPEN, 1, none,			\
+	  (unsigned int iface), (iface))				\
+	X(mango_net_tx, MANGO_HVC_NET_TX, 4, mem,			\
+	  (unsigned int iface, unsigned int dest,			\
+	   const unsigned char *p, unsigned int len),			\
+	  (iface, dest, p, len))					\
+	X(mango_net_rx, MANGO_HVC_NET_RX, 3, mem,			\
+	  (unsigned int iface, unsigned char *p, unsigned int len),	\
+	  (iface, p, len))						\
+	X(mango_net_close, MANGO_HVC_NET_CLOSE, 1, none,		\
+	  (unsigned int iface), (iface))				\
+	X(mango_net_set_mode, MANGO_HVC_NET_SET_MODE, 2, none,		\
+	  (unsigned int iface, unsigned int mode), (iface, mode))	\
+	X(mango_net_get_rx_size, MANGO_HVC_NET_RX_SIZE, 1, none,	\
+	  (unsigned int iface), (iface))				\
+	X(mango_net_reset, MANGO_HVC_NET_RESET, 1, none,		\
+	  (unsigned int iface), (iface))				\
+									\
+	X(mango_shm_notify, MANGO_HVC_SHM_NOTIFY, 1, mem,		\
+	  (unsigned int region), (region))
+
+#define MANGO_HVC_CLOBBER_none		"cc"
+#define MANGO_HVC_CLOBBER_mem		"cc", "memory"
+
+#define MANGO_HVC_ARG(a)		((unsigned int)(unsigned long)(a))
+
+#define MANGO_HVC_CALL0(nr, clob, ...)					\
+({									\
+	register unsigned int _r0 asm("r0");				\
+	asm volatile ("hvc	%1"					\
+		      : "=r" (_r0)					\
+		      : "I" (nr)					\
+		      : MANGO_HVC_CLOBBER_##clob,			\
+			  "r1", "r2", "r3", "ip");		\
+	_r0;								\
+})
+
+#define MANGO_HVC_CALL1(nr, clob, a1)					\
+({									\
+	register unsigned int _r0 asm("r0") = MANGO_HVC_ARG(a1);	\
+	asm volatile ("hvc	%1"					\
+		      : "+r" (_r0)					\
+		      : "I" (nr)					\
+		      : MANGO_HVC_CLOBBER_##clob,			\
+			  "r1", "r2", "r3", "ip");		\
+	_r0;								\
+})
+
+#define MANGO_HVC_CALL2(nr, clob, a1, a2)				\
+({									\
+	register unsigned int _r0 asm("r0") = MANGO_HVC_ARG(a1);	\
+	register unsigned int _r1 asm("r1") = MANGO_HVC_ARG(a2);	\
+	asm volatile ("hvc	%2"					\
+		      : "+r" (_r0), "+r" (_r1)				\
+		      : "I" (nr)					\
+		      : MANGO_HVC_CLOBBER_##clob,			\
+			  "r2", "r3", "ip");			\
+	_r0;								\
+})
+
+#define MANGO_HVC_CALL3(nr, clob, a1, a2, a3)				\
+({									\
+	register unsigned int _r0 asm("r0") = MANGO_HVC_ARG(a1);	\
+	register unsigned int _r1 asm("r1") = MANGO_HVC_ARG(a2);	\
+	register unsigned int _r2 asm("r2") = MANGO_HVC_ARG(a3);	\
+	asm volatile ("hvc	%3"					\
+		      : "+r" (_r0), "+r" (_r1), "+r" (_r2)		\
+		      : "I" (nr)					\
+		      : MANGO_HVC_CLOBBER_##clob, "r3", "ip");		\
+	_r0;								\
+})
+
+#define MANGO_HVC_CALL4(nr, clob, a1, a2, a3, a4)			\
+({									\
+	register unsigned int _r0 asm("r0") = MANGO_HVC_ARG(a1);	\
+	register unsigned int _r1 asm("r1") = MANGO_HVC_ARG(a2);	\
+	register unsigned int _r2 asm("r2") = MANGO_HVC_ARG(a3);	\
+	register unsigned int _r3 asm("r3") = MANGO_HVC_ARG(a4);	\
+	asm volatile ("hvc	%4"					\
+		      : "+r" (_r0), "+r" (_r1), "+r" (_r2), "+r" (_r3)	\
+		      : "I" (nr)					\
+		      : MANGO_HVC_CLOBBER_##clob, "ip");		\
+	_r0;								\
+})
+
+#define MANGO_HVC_UNPACK(...)		__VA_ARGS__
+#define __MANGO_HVC_BODY(n, nr, clob, ...)				\
+	MANGO_HVC_CALL##n(nr, clob, __VA_ARGS__)
+#define MANGO_HVC_BODY(n, nr, clob, args)				\
+	__MANGO_HVC_BODY(n, nr, clob, MANGO_HVC_UNPACK args)
+
+/* __mango_xxx(): the hypercall itself, always inline */
+#define MANGO_HVC_INLINE(name, nr, n, clob, proto, args)		\
+static inline unsigned int __##name proto				\
+{									\
+	return MANGO_HVC_BODY(n, nr, clob, args);			\
+}
+
+MANGO_HVC_TABLE(MANGO_HVC_INLINE)
+
+/*
+ * mango_xxx(): the API used by the drivers. It compiles to the bare hvc
+ * sequence, unless MANGO_HVC_EXTERN is defined, which selects the exported
+ * out-of-line versions of mango_core.
+ */
+#ifdef MANGO_HVC_EXTERN
+#define MANGO_HVC_DECLARE(name, nr, n, clob, proto, args)		\
+unsigned int name proto;
+#else
+#define MANGO_HVC_DECLARE(name, nr, n, clob, proto, args)		\
+static inline unsigned int name proto					\
+{									\
+	return __##name args;						\
+}
+#endif
+
+MANGO_HVC_TABLE(MANGO_HVC_DECLARE)
 
 #endif /* __MANGO_H__ */
@@ -0,0 +1,73 @@
+/*
+ * Mango traffic capture interface.
+ *
+ * Copyright (c) 2016 ilbers GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __MANGO_CAPTURE_H__
+#define __MANGO_CAPTURE_H__
+
+#include <linux/types.h>
+
+/* Record types */
+#define MANGO_CAP_DC_IRQ	1	/* Data channel IRQ, no data */
+#define MANGO_CAP_DC_TX		2	/* Data written to Mango */
+#define MANGO_CAP_NET_TX	3	/* Frame queued for Mango */
+#define MANGO_CAP_NET_RX	4	/* Frame received from Mango */
+#define MANGO_CAP_DC_RX		5	/* Data read from Mango */
+
+/*
+ * Pseudo-header in front of every captured frame of the pcap file, which
+ * uses LINKTYPE_USER0. Fields are in network byte order.
+ */
+struct mango_cap_hdr {
+	__u8  type;		/* MANGO_CAP_* */
+	__u8  cpu;		/* CPU which recorded the frame */
+	__be16 id;		/* Channel or interface */
+	__be32 len;		/* Original length of the data */
+} __attribute__((packed));
+
+#ifdef __KERNEL__
+
+#include <linux/rcupdate.h>
+
+typedef void (*mango_capture_fn)(unsigned int type, unsigned int id,
+				 const void *data, unsigned int len);
+
+/*
+ * The drivers own their capture hook, so they work without mango_capture.
+ * It installs itself with these when loaded and removes itself on unload.
+ */
+void mango_dc_set_capture(mango_capture_fn fn);
+void mango_net_set_capture(mango_capture_fn fn);
+
+/* Record an event, any context. Costs one test while no hook is installed */
+static inline void mango_capture(mango_capture_fn __rcu *hook,
+				 unsigned int type, unsigned int id,
+				 const void *data, unsigned int len)
+{
+	mango_capture_fn fn;
+
+	rcu_read_lock_sched_notrace();
+	fn = rcu_dereference_sched(*hook);
+	if (fn)
+		fn(type, id, data, len);
+	rcu_read_unlock_sched_notrace();
+}
+
+#endif /* __KERNEL__ */
+
+#endif /* __MANGO_CAPTURE_H__ */
@@ -0,0 +1,98 @@
+/*
+ * Mango Data Channel user interface.
+ *
+ * Copyright (c) 2014-2016 ilbers GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __MANGO_DC_H__
+#define __MANGO_DC_H__
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Data channel modes, passed to Mango as is */
+#define MANGO_DC_MODE_STREAM	0	/* Raw byte stream */
+#define MANGO_DC_MODE_MESSAGE	1	/* Each write is delivered as one record */
+
+/* Largest record accepted in message mode */
+#define MANGO_DC_MSG_MAX	254
+
+/* Largest number of descriptors handled by one batched call */
+#define MANGO_DC_MMSG_MAX	1024
+
+/* Message descriptor for batched transfers */
+struct mango_dc_msg {
+	__u64 buf;		/* User buffer */
+	__u32 len;		/* Buffer length, record length on receive */
+	__u32 flags;		/* MANGO_DC_MSG_* set on receive */
+};
+
+#define MANGO_DC_MSG_TRUNC	0x1	/* Record was longer than the buffer */
+
+struct mango_dc_mmsg {
+	__u64 msgs;		/* Array of struct mango_dc_msg */
+	__u32 vlen;		/* Number of descriptors in msgs */
+	__u32 min_count;	/* Receive: records to wait for */
+	__s32 timeout_ms;	/* Receive: < 0 waits forever, 0 never blocks */
+	__u32 count;		/* Number of messages transferred */
+};
+
+#define MANGO_DC_IOC_MAGIC	'M'
+
+#define MANGO_DC_SET_MODE	_IOW(MANGO_DC_IOC_MAGIC, 1, unsigned int)
+#define MANGO_DC_GET_MODE	_IOR(MANGO_DC_IOC_MAGIC, 2, unsigned int)
+#define MANGO_DC_SENDMMSG	_IOWR(MANGO_DC_IOC_MAGIC, 3, struct mango_dc_mmsg)
+#define MANGO_DC_RECVMMSG	_IOWR(MANGO_DC_IOC_MAGIC, 4, struct mango_dc_mmsg)
+#define MANGO_DC_GET_CPU	_IOR(MANGO_DC_IOC_MAGIC, 5, int)
+
+#ifdef __KERNEL__
+
+#include <linux/list.h>
+
+/* In-kernel data channel consumers */
+struct mango_dc_client;
+
+struct mango_dc_client_ops {
+	/*
+	 * Called from the channel IRQ thread for every contiguous span of
+	 * received data, one record per call in message mode. The span is
+	 * only valid during the call. May sleep.
+	 */
+	void (*rx)(void *priv, const unsigned char *data, unsigned int len);
+};
+
+/* Asynchronous transmit request */
+struct mango_dc_txbuf {
+	struct list_head    list;	/* Used by the driver */
+	const unsigned char *data;	/* Must stay valid until done() */
+	unsigned int        len;
+	unsigned int        sent;	/* Bytes accepted by Mango */
+	int                 status;	/* 0 or negative error, set for done() */
+	void (*done)(struct mango_dc_txbuf *tx);
+	void                *priv;
+};
+
+struct mango_dc_client *mango_dc_attach(int ch,
+					const struct mango_dc_client_ops *ops,
+					void *priv);
+void mango_dc_detach(struct mango_dc_client *client);
+int mango_dc_submit(struct mango_dc_client *client, struct mango_dc_txbuf *tx);
+int mango_dc_client_set_mode(struct mango_dc_client *client, unsigned int mode);
+int mango_dc_client_get_dest(struct mango_dc_client *client);
+
+#endif /* __KERNEL__ */
+
+#endif /* __MANGO_DC_H__ */
@@ -0,0 +1,48 @@
+/*
+ * Mango Shared Memory user interface.
+ *
+ * Copyright (c) 2016 ilbers GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __MANGO_SHM_H__
+#define __MANGO_SHM_H__
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * The region is mapped with mmap() of /dev/mango_shm. Reading the device
+ * returns the number of doorbells rung by the peer since the last read as
+ * a __u64, like an eventfd. poll() reports POLLIN while doorbells are
+ * pending.
+ */
+
+struct mango_shm_info {
+	__u64 size;		/* Region size, bytes */
+	__u32 region;		/* Mango region identifier */
+	__u32 flags;		/* MANGO_SHM_F_* */
+};
+
+#define MANGO_SHM_F_SOFT	0x1	/* Software backend, notify loops back */
+
+#define MANGO_SHM_IOC_MAGIC	'S'
+
+#define MANGO_SHM_GET_INFO	_IOR(MANGO_SHM_IOC_MAGIC, 1, struct mango_shm_info)
+#define MANGO_SHM_NOTIFY	_IO(MANGO_SHM_IOC_MAGIC, 2)
+/* Signal an eventfd on every doorbell, -1 detaches it */
+#define MANGO_SHM_SET_EVENTFD	_IOW(MANGO_SHM_IOC_MAGIC, 3, int)
+
+#endif /* __MANGO_SHM_H__ */
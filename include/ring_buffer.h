@@ -33,6 +33,15 @@
 		int size;						\
 	} name
 
+/* Ring buffer with storage allocated separately, see RING_BUFFER_ATTACH */
+#define RING_BUFFER_DYNAMIC(name, type)					\
+	typedef struct {						\
+		type *buf;						\
+		int start;						\
+		int fill;						\
+		int size;						\
+	} name
+
 #define RING_BUFFER_INIT(rb)						\
 	do								\
 	{								\
@@ -42,6 +51,25 @@
 	}								\
 	while(0)
 
+#define RING_BUFFER_ATTACH(rb, ptr, len)				\
+	do								\
+	{								\
+		rb.buf = ptr;						\
+		rb.start = 0;						\
+		rb.fill = 0;						\
+		rb.size = len;						\
+	}								\
+	while(0)
+
+/* Drop the contents, keeps the storage */
+#define RING_BUFFER_RESET(rb)						\
+	do								\
+	{								\
+		rb.start = 0;						\
+		rb.fill = 0;						\
+	}								\
+	while(0)
+
 #define RING_BUFFER_PUSH(rb, c)						\
 	do								\
 	{								\
@@ -71,11 +99,52 @@
 		_r;							\
 	})								\
 
+/* Index of the first free element */
+#define RING_BUFFER_TAIL(rb)						\
+	({								\
+		(rb.start + rb.fill) & (rb.size - 1);			\
+	})
+
+/* Account n elements stored at the tail, the oldest ones are overwritten */
+#define RING_BUFFER_COMMIT(rb, n)					\
+	do								\
+	{								\
+		int _n = (n);						\
+									\
+		if (rb.fill + _n > rb.size)				\
+		{							\
+			rb.start = (rb.start + rb.fill + _n - rb.size)	\
+				   & (rb.size - 1);			\
+			rb.fill = rb.size;				\
+		}							\
+		else							\
+		{							\
+			rb.fill += _n;					\
+		}							\
+	}								\
+	while(0)
+
+/* Discard n elements at the head */
+#define RING_BUFFER_SKIP(rb, n)						\
+	do								\
+	{								\
+		int _n = (n);						\
+									\
+		rb.start = (rb.start + _n) & (rb.size - 1);		\
+		rb.fill -= _n;						\
+	}								\
+	while(0)
+
 #define RING_BUFFER_FILL(rb)						\
 	({								\
 		rb.fill;						\
 	})
 
+#define RING_BUFFER_FREE(rb)						\
+	({								\
+		rb.size - rb.fill;					\
+	})
+
 #define RING_BUFFER_FULL(rb)						\
 	({								\
 		rb.fill == rb.size;					\
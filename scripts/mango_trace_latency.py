@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+#
+# Per-message latency breakdown from Mango tracepoints.
+#
+# Copyright (c) 2016 ilbers GmbH
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2
+# as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+"""
+Reads an ftrace text trace (tracing/trace or "trace-cmd report") with the
+mango_dc and mango_net events enabled, e.g.:
+
+    echo 1 > /sys/kernel/debug/tracing/events/mango_dc/enable
+    echo 1 > /sys/kernel/debug/tracing/events/mango_net/enable
+    ... run the workload ...
+    cat /sys/kernel/debug/tracing/trace > mango.trace
+    mango_trace_latency.py mango.trace
+
+Every data channel IRQ starts a message, which is matched with the first
+read from Mango that returns data. IRQs which brought no data of their own,
+because an earlier drain already took it or the channel was empty, are
+dropped when the next data is read from Mango or the IRQ thread exits. The
+latency of a message is split into:
+
+    irq->rx       hard IRQ until the IRQ thread reads it from Mango
+    rx->wakeup    drain until the readers are woken up
+    wakeup->read  until a reader fetches the data
+    total         hard IRQ until read
+"""
+
+import collections
+import re
+import sys
+
+LINE_RE = re.compile(r'^\s*(?P<task>.+?)-(?P<pid>\d+)\s+\[(?P<cpu>\d+)\]'
+                     r'(?:\s+\S+)?\s+(?P<ts>\d+\.\d+):\s+(?P<event>\w+):'
+                     r'\s*(?P<args>.*)$')
+ARG_RE = re.compile(r'(\w+)=(\S+)')
+
+STAGES = ('irq->rx', 'rx->wakeup', 'wakeup->read', 'total')
+
+
+class Message(object):
+    __slots__ = ('irq', 'rx', 'wakeup')
+
+    def __init__(self, ts):
+        self.irq = ts
+        self.rx = None
+        self.wakeup = None
+
+
+def drop_unmatched(queue):
+    """Drop the IRQs no data was read for, returns their number"""
+    kept = [msg for msg in queue if msg.rx is not None]
+    dropped = len(queue) - len(kept)
+    queue.clear()
+    queue.extend(kept)
+    return dropped
+
+
+def match_rx(queue, ts):
+    """
+    Data read from Mango belongs to the oldest IRQ waiting for it. The other
+    waiting IRQs were raised before this drain, which took their data too.
+    Returns the number of IRQs dropped.
+    """
+    for msg in queue:
+        if msg.rx is None:
+            msg.rx = ts
+            break
+    else:
+        return 0
+    return drop_unmatched(queue)
+
+
+def percentile(values, p):
+    idx = min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))
+    return values[idx]
+
+
+def print_table(title, samples):
+    print(title)
+    print('  %-14s %8s %10s %10s %10s %10s' %
+          ('', 'count', 'min', 'p50', 'p99', 'max'))
+    for name, values in samples:
+        if not values:
+            continue
+        values = sorted(values)
+        print('  %-14s %8d %10.1f %10.1f %10.1f %10.1f' %
+              (name, len(values), values[0], percentile(values, 50),
+               percentile(values, 99), values[-1]))
+    print()
+
+
+def main(path):
+    pending = collections.defaultdict(collections.deque)
+    lat = collections.defaultdict(lambda: collections.defaultdict(list))
+    lost = collections.Counter()
+    unmatched = collections.Counter()
+    net = collections.defaultdict(collections.Counter)
+    poll_work = collections.defaultdict(list)
+
+    with (sys.stdin if path == '-' else open(path)) as f:
+        for line in f:
+            m = LINE_RE.match(line)
+            if not m:
+                continue
+
+            ts = float(m.group('ts')) * 1e6
+            event = m.group('event')
+            args = dict(ARG_RE.findall(m.group('args')))
+
+            if event.startswith('mango_dc_'):
+                ch = int(args['ch'])
+                queue = pending[ch]
+
+                if event == 'mango_dc_irq':
+                    queue.append(Message(ts))
+                elif event == 'mango_dc_rx':
+                    lost[ch] += int(args['lost'])
+                    # An empty read ends a drain, it is no arrival
+                    if int(args['count']) > 0:
+                        unmatched[ch] += match_rx(queue, ts)
+                elif event == 'mango_dc_irq_exit':
+                    unmatched[ch] += drop_unmatched(queue)
+                elif event == 'mango_dc_wakeup':
+                    for msg in queue:
+                        if msg.rx is not None and msg.wakeup is None:
+                            msg.wakeup = ts
+                elif event == 'mango_dc_read' and int(args['ret']) > 0:
+                    unmatched[ch] += drop_unmatched(queue)
+                    while queue and queue[0].wakeup is not None:
+                        msg = queue.popleft()
+                        stages = lat[ch]
+                        stages['irq->rx'].append(msg.rx - msg.irq)
+                        stages['rx->wakeup'].append(msg.wakeup - msg.rx)
+                        stages['wakeup->read'].append(ts - msg.wakeup)
+                        stages['total'].append(ts - msg.irq)
+
+            elif event.startswith('mango_net_'):
+                iface = int(args['iface'])
+
+                if event == 'mango_net_xmit':
+                    net[iface]['xmit'] += 1
+                    if 'busy' in m.group('args'):
+                        net[iface]['busy'] += 1
+                elif event == 'mango_net_rx':
+                    net[iface]['rx'] += 1
+                elif event == 'mango_net_poll':
+                    poll_work[iface].append(int(args['work']))
+                elif event == 'mango_net_set_mode':
+                    net[iface]['mode ' + args['mode']] += 1
+
+    for ch in sorted(lat):
+        print_table('dc%d latency (us), %d bytes/records lost, '
+                    '%d IRQs without data' % (ch, lost[ch], unmatched[ch]),
+                    [(name, lat[ch][name]) for name in STAGES])
+
+    for iface in sorted(set(net) | set(poll_work)):
+        print('mango%d' % iface)
+        for key in sorted(net[iface]):
+            print('  %-14s %8d' % (key, net[iface][key]))
+        work = sorted(poll_work[iface])
+        if work:
+            print('  %-14s %8d polls, p50 %d, max %d packets' %
+                  ('poll', len(work), percentile(work, 50), work[-1]))
+        print()
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        sys.stderr.write('usage: %s <trace file | ->\n' % sys.argv[0])
+        sys.exit(1)
+    main(sys.argv[1])